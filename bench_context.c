@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "bios.h"
+#include "tinyos.h"
+#include "kernel_sched.h"
+
+/*
+	Context switch microbenchmark.
+
+	Measures the cost of a context switch with glibc swapcontext(), with
+	cpu_swap_context() and the cost of a kernel yield() between two
+	threads ping-ponging on one core.
+
+	Usage: bench_context [switches]
+*/
+
+static unsigned long SWITCHES = 1000000;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9*ts.tv_nsec;
+}
+
+static void report(const char* what, double elapsed, unsigned long nswitch)
+{
+	printf("%-24s %10lu switches  %8.1f nsec/switch\n", what, nswitch, 1E9*elapsed/nswitch);
+}
+
+#define STACK_SIZE (64*1024)
+
+
+/*
+	glibc ucontext
+ */
+
+static ucontext_t uc_main, uc_coro;
+
+static void uc_coroutine()
+{
+	while(1) swapcontext(&uc_coro, &uc_main);
+}
+
+static void bench_swapcontext()
+{
+	void* stack = malloc(STACK_SIZE);
+	getcontext(&uc_coro);
+	uc_coro.uc_stack.ss_sp = stack;
+	uc_coro.uc_stack.ss_size = STACK_SIZE;
+	uc_coro.uc_link = NULL;
+	makecontext(&uc_coro, uc_coroutine, 0);
+
+	double t0 = now();
+	for(unsigned long i=0; i<SWITCHES/2; i++)
+		swapcontext(&uc_main, &uc_coro);
+	report("swapcontext", now()-t0, SWITCHES);
+
+	free(stack);
+}
+
+
+/*
+	cpu_swap_context (inside the VM)
+ */
+
+static cpu_context_t cpu_main, cpu_coro;
+
+static void cpu_coroutine()
+{
+	while(1) cpu_swap_context(&cpu_coro, &cpu_main);
+}
+
+static void cpu_bootfunc()
+{
+	void* stack = malloc(STACK_SIZE);
+	cpu_initialize_context(&cpu_coro, stack, STACK_SIZE, cpu_coroutine);
+
+	double t0 = now();
+	for(unsigned long i=0; i<SWITCHES/2; i++)
+		cpu_swap_context(&cpu_main, &cpu_coro);
+	report("cpu_swap_context", now()-t0, SWITCHES);
+
+	free(stack);
+}
+
+
+/*
+	Kernel yield() between two threads of a process
+ */
+
+static volatile int yield_done;
+
+static int yield_thread(int argl, void* args)
+{
+	while(! yield_done) yield(SCHED_USER);
+	return 0;
+}
+
+static int yield_boot(int argl, void* args)
+{
+	Tid_t t = CreateThread(yield_thread, 0, NULL);
+
+	/* Let the other thread start */
+	yield(SCHED_USER);
+
+	double t0 = now();
+	for(unsigned long i=0; i<SWITCHES/2; i++)
+		yield(SCHED_USER);
+	double elapsed = now()-t0;
+	report("yield", elapsed, SWITCHES);
+
+	yield_done = 1;
+	ThreadJoin(t, NULL);
+	return 0;
+}
+
+
+int main(int argc, const char** argv)
+{
+	if(argc > 1) SWITCHES = strtoul(argv[1], NULL, 10);
+
+	bench_swapcontext();
+	vm_boot(cpu_bootfunc, 1, 0);
+	boot(1, 0, yield_boot, 0, NULL);
+
+	return 0;
+}
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bios.h"
+#include "tinyos.h"
+
+/*
+	System call scalability microbenchmark.
+
+	Runs the same workload on 1, 2 and 4 cores and reports the aggregate
+	throughput:
+	- getpid:   every thread calls GetPid() in a loop
+	- pipe:     pairs of threads ping-pong a byte over their own two pipes
+	- spawn:    every thread creates and joins threads in a loop
+	- bulk:     one thread streams 64 KB writes through a pipe to another
+	- proxy:    like bulk, but a middle thread moves the data from one pipe
+	            to another with Read and Write
+	- splice:   like proxy, but the middle thread uses Splice
+	- connect:  one thread connects sockets to a port, another accepts them
+	- sockpair: one thread creates connected pairs with SocketPair()
+
+	With a single kernel-wide lock, none of these scale with the number
+	of cores.
+
+	Usage: bench_syscalls [iterations]
+*/
+
+static unsigned long ITERS = 200000;
+static uint bench_cores;
+
+#define THREADS 4
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9*ts.tv_nsec;
+}
+
+static void report(const char* what, uint cores, double elapsed, unsigned long nops)
+{
+	printf("%-10s cores=%u %10lu ops  %8.1f nsec/op  %8.2f Mops/sec\n",
+		what, cores, nops, 1E9*elapsed/nops, 1E-6*nops/elapsed);
+}
+
+static int run_threads(Task task, int argl, void** args)
+{
+	Tid_t t[THREADS];
+	for(int i=0; i<THREADS; i++)
+		t[i] = CreateThread(task, argl, args ? args[i] : NULL);
+	for(int i=0; i<THREADS; i++)
+		ThreadJoin(t[i], NULL);
+	return 0;
+}
+
+
+/*
+	GetPid
+ */
+
+static int getpid_thread(int argl, void* args)
+{
+	for(unsigned long i=0; i<ITERS; i++)
+		GetPid();
+	return 0;
+}
+
+
+/*
+	Pipe ping-pong
+ */
+
+typedef struct { Fid_t in, out; int first; } pingpong;
+
+static int pipe_thread(int argl, void* args)
+{
+	pingpong* pp = args;
+	char c = 'x';
+	unsigned long n = ITERS/10;
+	if(pp->first) Write(pp->out, &c, 1);
+	for(unsigned long i=0; i<n; i++) {
+		if(Read(pp->in, &c, 1)!=1) break;
+		if(pp->first && i==n-1) break;
+		Write(pp->out, &c, 1);
+	}
+	return 0;
+}
+
+
+/*
+	Pipe bulk transfer
+ */
+
+#define BULK_CHUNK (64*1024)
+#define BULK_BYTES (256ul*1024*1024)
+
+static int bulk_reader(int argl, void* args)
+{
+	static char buf[BULK_CHUNK];
+	while(Read(argl, buf, BULK_CHUNK) > 0);
+	return 0;
+}
+
+
+/*
+	Pipe to pipe proxy
+ */
+
+static int proxy_thread(int argl, void* args)
+{
+	static char buf[BULK_CHUNK];
+	Fid_t* fd = args;
+	int n;
+	while((n = Read(fd[0], buf, BULK_CHUNK)) > 0)
+		for(int m=0; m<n; ) m += Write(fd[1], buf+m, n-m);
+	Close(fd[1]);
+	return 0;
+}
+
+static int splice_thread(int argl, void* args)
+{
+	Fid_t* fd = args;
+	while(Splice(fd[0], fd[1], BULK_CHUNK) > 0);
+	Close(fd[1]);
+	return 0;
+}
+
+static void run_proxy(const char* what, Task middle)
+{
+	static char chunk[BULK_CHUNK];
+	pipe_t in, out;
+	Pipe(&in); Pipe(&out);
+	/* Large buffers, so that we measure copying rather than switching */
+	SetPipeCapacity(in.write, 256*1024);
+	SetPipeCapacity(out.write, 256*1024);
+	Fid_t fd[2] = { in.read, out.write };
+	Tid_t mid = CreateThread(middle, 0, fd);
+	Tid_t rd = CreateThread(bulk_reader, out.read, NULL);
+	double t0 = now();
+	for(unsigned long n=0; n<BULK_BYTES/4; ) {
+		int rc = Write(in.write, chunk, BULK_CHUNK);
+		if(rc <= 0) break;
+		n += rc;
+	}
+	Close(in.write);
+	ThreadJoin(mid, NULL);
+	ThreadJoin(rd, NULL);
+	double elapsed = now()-t0;
+	Close(in.read); Close(out.read);
+	printf("%-10s cores=%u %10lu MB   %8.2f GB/sec\n",
+		what, bench_cores, (BULK_BYTES/4)>>20, 1E-9*(BULK_BYTES/4)/elapsed);
+}
+
+
+/*
+	Socket connection setup
+ */
+
+#define SOCK_PORT 100
+
+static int accept_loop(int argl, void* args)
+{
+	for(unsigned long i=0; i<ITERS/100; i++) {
+		Fid_t s = Accept(argl);
+		if(s == NOFILE) break;
+		Close(s);
+	}
+	return 0;
+}
+
+
+/*
+	Thread creation
+ */
+
+static int empty_thread(int argl, void* args) { return 0; }
+
+static int spawn_thread_loop(int argl, void* args)
+{
+	for(unsigned long i=0; i<ITERS/100; i++)
+		ThreadJoin(CreateThread(empty_thread, 0, NULL), NULL);
+	return 0;
+}
+
+
+
+static int bench_boot(int argl, void* args)
+{
+	double t0;
+
+	t0 = now();
+	run_threads(getpid_thread, 0, NULL);
+	report("getpid", bench_cores, now()-t0, THREADS*ITERS);
+
+	pingpong pp[THREADS];
+	void* ppargs[THREADS];
+	for(int i=0; i<THREADS; i+=2) {
+		pipe_t p1, p2;
+		Pipe(&p1); Pipe(&p2);
+		pp[i] = (pingpong){ .in = p2.read, .out = p1.write, .first = 1 };
+		pp[i+1] = (pingpong){ .in = p1.read, .out = p2.write, .first = 0 };
+	}
+	for(int i=0; i<THREADS; i++) ppargs[i] = &pp[i];
+
+	t0 = now();
+	run_threads(pipe_thread, 0, ppargs);
+	report("pipe", bench_cores, now()-t0, THREADS*(ITERS/10));
+
+	t0 = now();
+	run_threads(spawn_thread_loop, 0, NULL);
+	report("spawn", bench_cores, now()-t0, THREADS*(ITERS/100));
+
+	static char chunk[BULK_CHUNK];
+	pipe_t bp;
+	Pipe(&bp);
+	Tid_t rd = CreateThread(bulk_reader, bp.read, NULL);
+	t0 = now();
+	for(unsigned long n=0; n<BULK_BYTES; ) {
+		int rc = Write(bp.write, chunk, BULK_CHUNK);
+		if(rc <= 0) break;
+		n += rc;
+	}
+	Close(bp.write);
+	ThreadJoin(rd, NULL);
+	double elapsed = now()-t0;
+	printf("%-10s cores=%u %10lu MB   %8.2f GB/sec\n",
+		"bulk", bench_cores, BULK_BYTES>>20, 1E-9*BULK_BYTES/elapsed);
+
+	run_proxy("proxy", proxy_thread);
+	run_proxy("splice", splice_thread);
+
+	Fid_t lsock = Socket(SOCK_PORT);
+	Listen(lsock);
+	Tid_t acc = CreateThread(accept_loop, lsock, NULL);
+	t0 = now();
+	for(unsigned long i=0; i<ITERS/100; i++) {
+		Fid_t s = Socket(NOPORT);
+		Connect(s, SOCK_PORT, -1);
+		Close(s);
+	}
+	ThreadJoin(acc, NULL);
+	report("connect", bench_cores, now()-t0, ITERS/100);
+	Close(lsock);
+
+	t0 = now();
+	for(unsigned long i=0; i<ITERS/100; i++) {
+		Fid_t s[2];
+		SocketPair(s);
+		Close(s[0]);
+		Close(s[1]);
+	}
+	report("sockpair", bench_cores, now()-t0, ITERS/100);
+
+	return 0;
+}
+
+
+int main(int argc, const char** argv)
+{
+	if(argc > 1) ITERS = strtoul(argv[1], NULL, 10);
+
+	uint cores[] = { 1, 2, 4 };
+	for(int i=0; i<3; i++) {
+		bench_cores = cores[i];
+		boot(cores[i], 0, bench_boot, 0, NULL);
+	}
+
+	return 0;
+}
@@ -123,7 +123,11 @@ static void initialize()
 	physical_cores = get_nprocs();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	/* 
+		Interrupts are masked in software (see intr_disabled), so the
+		handler must not block SIGUSR1 while it runs. 
+	 */
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -156,6 +160,15 @@ static inline Core* curr_core() {
 	return CORE+cpu_core_id;
 }
 
+/*
+	The software interrupt mask of the core. It is thread-local to the
+	core thread, rather than a field of Core, so that it is set with a 
+	single store to the current core: a context may be switched out by an
+	interrupt and resumed on another core between looking up its Core and 
+	storing to it.
+*/
+_Thread_local volatile sig_atomic_t intr_disabled;
+
 
 /*
 	Cause PIC daemon to loop. This needs to happen when we wish 
@@ -180,6 +193,7 @@ static void* core_thread(void* _core)
 
 	/* Clear pending bitvec */
 	core->intr_pending = 0;
+	intr_disabled = 0;
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
@@ -342,6 +356,50 @@ static inline void dispatch_interrupts(Core* core)
 }
 
 
+/*
+	Interrupt masking is done in software, by the per-core flag
+	intr_disabled, instead of blocking SIGUSR1 in the signal mask
+	of the core thread (which costs a system call every time).
+
+	When a signal arrives while interrupts are disabled, the handler
+	returns immediately, leaving the interrupt pending. Pending
+	interrupts are dispatched when interrupts are re-enabled.
+
+	The flag is only accessed by the core thread itself (and its 
+	signal handler), so signal fences are enough for ordering.
+ */
+static inline void intr_disable()
+{
+	intr_disabled = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void intr_enable()
+{
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	intr_disabled = 0;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+	Enable interrupts for the current core, dispatching any that became 
+	pending while interrupts were disabled.
+
+	Note that while interrupts are enabled, or a handler is dispatched,
+	we may switch contexts and be resumed on a different core. Hence, the
+	core is looked up again once interrupts are disabled.
+ */
+static inline void intr_enable_and_replay()
+{
+	intr_enable();
+	while(curr_core()->intr_pending) {
+		intr_disable();
+		dispatch_interrupts(curr_core());
+		intr_enable();
+	}
+}
+
+
 /*
 	This is the signal handler for core threads, to handle interrupts.
  */
@@ -353,7 +411,13 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	core->irq_count++;
 #endif
 
+	/* Interrupts are disabled, leave them pending */
+	if(intr_disabled) return;
+
+	/* Handlers are executed with interrupts disabled */
+	intr_disable();
 	dispatch_interrupts(core);
+	intr_enable_and_replay();
 }
 
 
@@ -1017,13 +1081,10 @@ void cpu_core_halt()
 	/* Sleep for 10 msec */
 	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
 	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-	int rc = sigwaitinfo(&sigusr1_set, &info);
+	/* Do not sleep if some interrupt was left pending */
+	int rc = (core->intr_pending == 0) ? sigwaitinfo(&sigusr1_set, &info) : 1;
 
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
+	if(rc<=0) {
 		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
 	}
 
@@ -1035,6 +1096,11 @@ void cpu_core_halt()
 	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
 
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+
+	/* Dispatch what woke us up (if we are not masked) */
+	if(! intr_disabled) {
+		intr_enable_and_replay();
+	}
 }
 
 static int __core_restart(uint c)
@@ -1092,32 +1158,174 @@ void cpu_ici(uint core)
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	int enabled = cpu_disable_interrupts();
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(enabled) cpu_enable_interrupts();
 }
 
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return ! intr_disabled;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	int enabled = ! intr_disabled;
+	intr_disable();
+	return enabled;
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	intr_enable_and_replay();
 }
 
 
+#if defined(CPU_CONTEXT_ASM)
+
+/*
+	A new context returns into this, if its function ever returns.
+ */
+static void cpu_context_exit()
+{
+	FATAL("A CPU context function returned");
+}
+
+#if defined(__x86_64__)
+
+/*
+	void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+
+	Push the callee-saved registers and the x87/SSE control words on the 
+	current stack, save %rsp into oldctx, load %rsp from newctx and pop 
+	its saved state.
+ */
+__asm__(
+	".text\n"
+	".globl cpu_swap_context\n"
+	".type cpu_swap_context, @function\n"
+	".p2align 4\n"
+	"cpu_swap_context:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr 4(%rsp)\n"
+	"	fnstcw (%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	ldmxcsr 4(%rsp)\n"
+	"	fldcw (%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size cpu_swap_context, .-cpu_swap_context\n"
+);
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The top of the stack, aligned to 16 bytes */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* sp = (uint64_t*) top;
+
+	/* 
+		Build the frame popped by cpu_swap_context. When ctx_func is entered, 
+		the stack looks as if it had been called, i.e., %rsp+8 is 16-byte
+		aligned.
+	 */
+	*--sp = (uint64_t) cpu_context_exit;	/* return address of ctx_func */
+	*--sp = (uint64_t) ctx_func;	/* return address of cpu_swap_context */
+	for(int i=0; i<6; i++)
+		*--sp = 0;	/* rbp, rbx, r12-r15 */
+	*--sp = (uint64_t)0x1F80 << 32 | 0x037F;	/* default mxcsr and fpu control word */
+
+	ctx->sp = sp;
+}
+
+#elif defined(__aarch64__)
+
+/*
+	void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+
+	Save x19-x30, d8-d15 and fpcr on the current stack, save sp into oldctx, 
+	load sp from newctx and restore its saved state. 
+ */
+__asm__(
+	".text\n"
+	".globl cpu_swap_context\n"
+	".type cpu_swap_context, %function\n"
+	".p2align 4\n"
+	"cpu_swap_context:\n"
+	"	sub sp, sp, #176\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mrs x9, fpcr\n"
+	"	str x9, [sp, #160]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	ldr x9, [x1]\n"
+	"	mov sp, x9\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	ldr x9, [sp, #160]\n"
+	"	msr fpcr, x9\n"
+	"	add sp, sp, #176\n"
+	"	ret\n"
+	".size cpu_swap_context, .-cpu_swap_context\n"
+	"\n"
+	/* A new context starts here, with the function in x19 */
+	".type cpu_context_start, %function\n"
+	"cpu_context_start:\n"
+	"	blr x19\n"
+	"	blr x20\n"
+	".size cpu_context_start, .-cpu_context_start\n"
+);
+
+void cpu_context_start();
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The top of the stack, aligned to 16 bytes */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* sp = (uint64_t*) (top - 176);
+
+	/* Build the frame restored by cpu_swap_context */
+	memset(sp, 0, 176);
+	sp[0] = (uint64_t) ctx_func;	/* x19 */
+	sp[1] = (uint64_t) cpu_context_exit;	/* x20 */
+	sp[11] = (uint64_t) cpu_context_start;	/* x30 */
+
+	ctx->sp = sp;
+}
+
+#endif
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1129,8 +1337,8 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
   ctx->uc_stack.ss_size = ss_size;
   ctx->uc_stack.ss_flags = 0;
 
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
+  /* Interrupts are masked in software, so SIGUSR1 must stay unblocked */
+  ctx->uc_sigmask = core_signal_set;
   makecontext(ctx, (void*) ctx_func, 0);
 }
 
@@ -1140,6 +1348,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
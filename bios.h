@@ -407,8 +407,20 @@ void cpu_core_restart_all();
 
 /**
 	@brief A type for saving CPU context into.
+
+	On x86-64 and aarch64, context switching is done by hand-written code
+	that saves only the callee-saved registers on the stack of the
+	suspended context; the context itself only stores the stack pointer.
+	Notably, the signal mask is not saved or restored.
+
+	On other architectures, the (much slower) @c ucontext_t API is used.
 */
+#if defined(__x86_64__) || defined(__aarch64__)
+#define CPU_CONTEXT_ASM 1
+typedef struct { void* sp; } cpu_context_t;
+#else
 typedef ucontext_t cpu_context_t;
+#endif
 
 
 /**
@@ -55,6 +55,12 @@ void Mutex_Lock(Mutex* lock)
 }
 
 
+int Mutex_TryLock(Mutex* lock)
+{
+  return ! __atomic_test_and_set(lock, __ATOMIC_ACQUIRE);
+}
+
+
 void Mutex_Unlock(Mutex* lock)
 {
   __atomic_clear(lock, __ATOMIC_RELEASE);
@@ -207,65 +213,14 @@ void Cond_Broadcast(CondVar* cv)
 
 /*
  *
- * The kernel locks
+ * Kernel waiting
  *
  */
 
-/**
- * @brief The kernel lock.
- *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
- */
-
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
-
-/* Semaphore counter */
-static int kernel_sem = 1;
-
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
-
-void kernel_lock()
-{
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
-}
-
-void kernel_unlock()
-{
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
-}
-
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
-
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
-
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
-
-	return ret;
+	return cv_wait(mx, cv, cause, timeout);
 }
 
 void kernel_signal(CondVar* cv) 
@@ -278,14 +233,7 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
+void kernel_sleep(Mutex* mx, Thread_state newstate, enum SCHED_CAUSE cause)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+	sleep_releasing(newstate, mx, cause, NO_TIMEOUT);
 }
-
-
-
-
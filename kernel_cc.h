@@ -32,32 +32,42 @@
 
 
 
-/*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
- */
-
 /**
-	@brief Lock the kernel.
+	@brief Try to lock a mutex without waiting.
+
+	This is a kernel-only helper, useful where blocking on a lock could
+	deadlock (e.g., when a core holding its own scheduler lock probes 
+	the lock of another core).
+
+	@returns 1 if the mutex was locked by this call, 0 if it was already locked.
  */
-void kernel_lock();
+int Mutex_TryLock(Mutex* lock);
 
-/**
-	@brief Unlock the kernel.
+
+/*
+ * Kernel waiting and signalling.
+ *
+ * There is no big kernel lock. Each kernel subsystem protects its data
+ * with its own mutex (e.g., the process table, the file table of each process,
+ * each pipe). These are wrappers for waiting on kernel conditions, under
+ * the mutex of the subsystem.
  */
-void kernel_unlock();
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Wait on a condition variable, releasing a kernel mutex.
+
+	The mutex @c mx must be held by the caller. It is released atomically
+	as the thread goes to sleep and is re-acquired before returning.
+
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
 	@brief Signal a kernel condition to one waiter.
@@ -73,12 +83,11 @@ void kernel_broadcast(CondVar* cv);
 
 
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Put thread to sleep, releasing a kernel mutex.
 
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	This is simply a wrapper for @c sleep_releasing.
   */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
+void kernel_sleep(Mutex* mx, Thread_state state, enum SCHED_CAUSE cause);
 
 
 
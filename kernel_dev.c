@@ -5,6 +5,7 @@
 #include "kernel_sched.h"
 #include "kernel_streams.h"
 #include "kernel_proc.h"
+#include "kernel_poll.h"
 
 /*************************************
 
@@ -70,6 +71,9 @@ typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
   CondVar rx_ready;
+  int has_lookahead;      /* A byte was taken from the device by Poll... */
+  char lookahead;         /* ... and this is it */
+  poll_queue pollq;
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -90,7 +94,10 @@ void serial_rx_handler()
    */
   for(int i=0;i<bios_serial_ports();i++) {
     serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(&dcb->spinlock);
     Cond_Broadcast(&dcb->rx_ready);
+    Mutex_Unlock(&dcb->spinlock);
+    poll_notify(&dcb->pollq);
   }
   if(pre) preempt_on;
 }
@@ -103,22 +110,31 @@ int serial_read(void* dev, char *buf, unsigned int size)
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
 
   uint count =  0;
 
   while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
+    int valid;
+    if(dcb->has_lookahead) {
+      buf[count] = dcb->lookahead;
+      dcb->has_lookahead = 0;
+      valid = 1;
+    }
+    else
+      valid = bios_read_serial(dcb->devno, &buf[count]);
     
     if (valid) {
       count++;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      kernel_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
+  Mutex_Unlock(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
   return count;
@@ -162,6 +178,29 @@ int serial_write(void* dev, const char* buf, unsigned int size)
 }
 
 
+/*
+  There is no way to ask the device whether it has data without
+  reading it, so we keep the byte we read for the next serial_read.
+  Writes only wait for the device to catch up, so they are always ready.
+*/
+int serial_poll(void* dev, poll_table* pt)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  poll_wait(pt, &dcb->pollq);
+
+  int pre = preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+  if(! dcb->has_lookahead)
+    dcb->has_lookahead = bios_read_serial(dcb->devno, &dcb->lookahead);
+  int ready = dcb->has_lookahead;
+  Mutex_Unlock(&dcb->spinlock);
+  if(pre) preempt_on;
+
+  return ready ? (POLL_READ | POLL_WRITE) : POLL_WRITE;
+}
+
+
 int serial_close(void* dev) 
 {
   return 0;
@@ -180,7 +219,8 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
-  .Close = serial_close
+  .Close = serial_close,
+  .Poll = serial_poll
 };
 
 
@@ -211,6 +251,8 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].has_lookahead = 0;
+    poll_queue_init(&serial_dcb[i].pollq);
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
@@ -9,6 +9,7 @@
 
 #include "util.h"
 #include "bios.h"
+#include "tinyos.h"
 
 /**
   @file kernel_dev.h
@@ -34,6 +35,8 @@
 */
 
 
+struct poll_table;
+
 /**
   @brief The device-specific file operations table.
 
@@ -92,6 +95,40 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+  /** @brief Pipe access (optional).
+
+    Return the pipe that stream 'this' reads from (if 'write' is 0) or
+    writes to (if 'write' is 1), or NULL if it has none. With it, 
+    Splice moves bytes from one pipe buffer to the other directly. 
+   */
+    void* (*GetPipe)(void* this, int write);
+
+  /** @brief Vectored read operation (optional).
+
+    Like Read, but the data is stored in the 'n' buffers of 'iov', 
+    in a single operation. If missing, ReadV calls Read for each buffer.
+    If 'nonblock' is set, return WOULD_BLOCK instead of waiting; a 
+    non-blocking Read is done with it too.
+   */
+    int (*ReadV)(void* this, const iovec_t* iov, unsigned int n, int nonblock);
+
+  /** @brief Vectored write operation (optional).
+
+    Like Write, but the data is taken from the 'n' buffers of 'iov',
+    in a single operation. If missing, WriteV calls Write for each buffer.
+    'nonblock' is as in ReadV.
+   */
+    int (*WriteV)(void* this, const iovec_t* iov, unsigned int n, int nonblock);
+
+  /** @brief Readiness query (optional).
+
+    Return the events of stream 'this' (POLL_READ, POLL_WRITE, POLL_ERROR, POLL_HANGUP)
+    that are true now. If 'pt' is not NULL, also register it with 
+    @c poll_wait on the poll queue(s) that are notified when this changes.
+    If missing, Poll takes the stream as always ready.
+   */
+    int (*Poll)(void* this, struct poll_table* pt);
 } file_ops;
 
 
@@ -0,0 +1,262 @@
+#include "tinyos.h"
+#include "kernel_events.h"
+#include "kernel_cc.h"
+#include "kernel_dev.h"
+#include "kernel_streams.h"
+
+/*
+The watches of every FCB, and adding and removing watches, are protected by the
+watch lock. It is taken before the lock of an event queue. Watches change rarely,
+so this lock is not on the path of the events themselves.
+*/
+static Mutex watch_lock = MUTEX_INIT;
+
+static int event_queue_close(void *this);
+
+static file_ops event_queue_ops = {
+	.Open = NULL,
+	.Read = NULL,
+	.Write = NULL,
+	.Close = event_queue_close};
+
+/* The events of a stream, see Poll() */
+static int stream_poll(FCB *fcb, poll_table *pt)
+{
+	if (fcb->streamfunc->Poll == NULL)
+		return POLL_READ | POLL_WRITE; // It never blocks
+	return fcb->streamfunc->Poll(fcb->streamobj, pt);
+}
+
+/* Put a watch on the ready list of its queue. Called with preemption off */
+static void watch_wake(poll_table *pt)
+{
+	event_watch *w = (event_watch *)pt;
+	event_queue *eq = w->eq;
+
+	Mutex_Lock(&eq->ready_lock);
+	if (!w->queued)
+	{
+		w->queued = 1;
+		rlist_push_back(&eq->ready, &w->ready_node);
+		kernel_signal(&eq->has_events);
+	}
+	Mutex_Unlock(&eq->ready_lock);
+}
+
+/* Register a watch on its stream, and queue it if the stream is ready now */
+static void watch_arm(event_watch *w)
+{
+	if (stream_poll(w->fcb, &w->pt) & (w->events | POLL_ERROR | POLL_HANGUP))
+	{
+		int pre = preempt_off;
+		watch_wake(&w->pt);
+		if (pre)
+			preempt_on;
+	}
+}
+
+/* Remove a watch. Called with the watch lock and the lock of its queue held */
+static void watch_free(event_watch *w)
+{
+	event_queue *eq = w->eq;
+
+	poll_table_release(&w->pt);
+
+	int pre = preempt_off;
+	Mutex_Lock(&eq->ready_lock);
+	if (w->queued)
+		rlist_remove(&w->ready_node);
+	Mutex_Unlock(&eq->ready_lock);
+	if (pre)
+		preempt_on;
+
+	rlist_remove(&w->eq_node);
+	rlist_remove(&w->fcb_node);
+	free(w);
+}
+
+void event_forget(FCB *fcb)
+{
+	Mutex_Lock(&watch_lock);
+	while (!is_rlist_empty(&fcb->watches))
+	{
+		event_watch *w = fcb->watches.next->obj;
+		event_queue *eq = w->eq;
+		Mutex_Lock(&eq->lock);
+		watch_free(w);
+		Mutex_Unlock(&eq->lock);
+	}
+	Mutex_Unlock(&watch_lock);
+}
+
+static int event_queue_close(void *this)
+{
+	event_queue *eq = (event_queue *)this;
+
+	Mutex_Lock(&watch_lock);
+	Mutex_Lock(&eq->lock);
+	while (!is_rlist_empty(&eq->watches))
+		watch_free(eq->watches.next->obj);
+	Mutex_Unlock(&eq->lock);
+	Mutex_Unlock(&watch_lock);
+
+	free(eq);
+	return 0;
+}
+
+Fid_t sys_EventQueue()
+{
+	Fid_t fid[1];
+	FCB *fcb[1];
+	if (!FCB_reserve(1, fid, fcb))
+		return NOFILE;
+
+	event_queue *eq = (event_queue *)xmalloc(sizeof(event_queue));
+	eq->lock = MUTEX_INIT;
+	rlnode_init(&eq->watches, NULL);
+	eq->ready_lock = MUTEX_INIT;
+	rlnode_init(&eq->ready, NULL);
+	eq->has_events = COND_INIT;
+
+	fcb[0]->streamobj = eq;
+	fcb[0]->streamfunc = &event_queue_ops;
+	return fid[0];
+}
+
+/* The watch of a queue on a stream, or NULL. Called with the watch lock held */
+static event_watch *find_watch(FCB *fcb, event_queue *eq)
+{
+	for (rlnode *n = fcb->watches.next; n != &fcb->watches; n = n->next)
+		if (((event_watch *)n->obj)->eq == eq)
+			return n->obj;
+	return NULL;
+}
+
+int sys_EventCtl(Fid_t efd, event_op op, Fid_t fd, int events)
+{
+	FCB *efcb = get_fcb_ref(efd);
+	FCB *fcb = get_fcb_ref(fd);
+	int ret = -1;
+
+	// Event queues do not watch event queues
+	if (efcb == NULL || efcb->streamfunc != &event_queue_ops ||
+		fcb == NULL || fcb->streamfunc == &event_queue_ops)
+		goto done;
+
+	event_queue *eq = efcb->streamobj;
+
+	Mutex_Lock(&watch_lock);
+	Mutex_Lock(&eq->lock);
+
+	event_watch *w = find_watch(fcb, eq);
+	switch (op)
+	{
+	case EVENT_ADD:
+		if (w != NULL)
+			break;
+		w = (event_watch *)xmalloc(sizeof(event_watch));
+		poll_table_init(&w->pt, watch_wake);
+		w->eq = eq;
+		w->fcb = fcb;
+		w->fd = fd;
+		w->events = events;
+		w->queued = 0;
+		rlnode_init(&w->eq_node, w);
+		rlnode_init(&w->fcb_node, w);
+		rlnode_init(&w->ready_node, w);
+		rlist_push_back(&eq->watches, &w->eq_node);
+		rlist_push_back(&fcb->watches, &w->fcb_node);
+		watch_arm(w);
+		ret = 0;
+		break;
+	case EVENT_MODIFY:
+		if (w == NULL)
+			break;
+		w->events = events;
+		watch_arm(w);
+		ret = 0;
+		break;
+	case EVENT_DELETE:
+		if (w == NULL)
+			break;
+		watch_free(w);
+		ret = 0;
+		break;
+	}
+
+	Mutex_Unlock(&eq->lock);
+	Mutex_Unlock(&watch_lock);
+
+done:
+	if (efcb != NULL)
+		FCB_decref(efcb);
+	if (fcb != NULL)
+		FCB_decref(fcb);
+	return ret;
+}
+
+int sys_WaitEvents(Fid_t efd, event_t *events, unsigned int max, timeout_t timeout)
+{
+	if (events == NULL || max == 0)
+		return -1;
+
+	FCB *efcb = get_fcb_ref(efd);
+	if (efcb == NULL)
+		return -1;
+	if (efcb->streamfunc != &event_queue_ops)
+	{
+		FCB_decref(efcb);
+		return -1;
+	}
+
+	event_queue *eq = efcb->streamobj;
+	TimerDuration deadline = poll_deadline(timeout);
+	unsigned int n = 0;
+
+	for (;;)
+	{
+		// Holding the queue lock, the watches (and their streams) stay around
+		Mutex_Lock(&eq->lock);
+		while (n < max)
+		{
+			event_watch *w = NULL;
+			int pre = preempt_off;
+			Mutex_Lock(&eq->ready_lock);
+			if (!is_rlist_empty(&eq->ready))
+			{
+				w = rlist_pop_front(&eq->ready)->obj;
+				w->queued = 0;
+			}
+			Mutex_Unlock(&eq->ready_lock);
+			if (pre)
+				preempt_on;
+
+			if (w == NULL)
+				break;
+
+			// A change may not be an event of interest, then the watch waits for the next one
+			int ev = stream_poll(w->fcb, NULL) & (w->events | POLL_ERROR | POLL_HANGUP);
+			if (ev)
+				events[n++] = (event_t){.fd = w->fd, .events = ev};
+		}
+		Mutex_Unlock(&eq->lock);
+
+		if (n > 0 || timeout == 0)
+			break;
+
+		int expired = 0;
+		int pre = preempt_off;
+		Mutex_Lock(&eq->ready_lock);
+		while (is_rlist_empty(&eq->ready) && !expired)
+			expired = !poll_sleep(&eq->ready_lock, &eq->has_events, deadline);
+		Mutex_Unlock(&eq->ready_lock);
+		if (pre)
+			preempt_on;
+
+		if (expired)
+			break;
+	}
+
+	FCB_decref(efcb);
+	return n;
+}
@@ -0,0 +1,67 @@
+#ifndef __KERNEL_EVENTS_H
+#define __KERNEL_EVENTS_H
+
+#include "tinyos.h"
+#include "kernel_poll.h"
+#include "kernel_streams.h"
+
+/**
+	@file kernel_events.h
+	@brief Event queues.
+
+	@defgroup events Event queues.
+	@ingroup kernel
+	@brief Event queues.
+
+	An event queue is a stream that watches other streams. Each watch
+	has a poll table (see @ref poll) on the poll queues of its stream,
+	so that the stream puts it on the ready list of the event queue
+	when its state changes. @c WaitEvents() only looks at the watches
+	on the ready list, so its cost does not depend on the number of
+	watched streams.
+
+	A watch does not keep its stream open. When the last reference to
+	a watched FCB is dropped, @ref event_forget removes its watches.
+
+	@{
+*/
+
+
+/** @brief The state of an event queue. */
+typedef struct event_queue
+{
+	Mutex lock;				/**< @brief Protects @c watches, and the streams of the ready watches */
+	rlnode watches;			/**< @brief All the watches of the queue */
+	Mutex ready_lock;		/**< @brief Protects @c ready, taken with preemption off */
+	rlnode ready;			/**< @brief The watches whose streams have changed */
+	CondVar has_events;		/**< @brief Signalled when a watch becomes ready */
+} event_queue;
+
+
+/** @brief Interest in the events of a stream. */
+typedef struct event_watch
+{
+	poll_table pt;			/**< @brief On the poll queues of the stream (must be first) */
+	event_queue* eq;		/**< @brief The queue of the watch */
+	FCB* fcb;				/**< @brief The stream */
+	Fid_t fd;				/**< @brief The file id reported for the stream */
+	int events;				/**< @brief The events of interest */
+	int queued;				/**< @brief Set while on the ready list */
+	rlnode eq_node;			/**< @brief In the watches of the queue */
+	rlnode fcb_node;		/**< @brief In the watches of the FCB */
+	rlnode ready_node;		/**< @brief In the ready list of the queue */
+} event_watch;
+
+
+/**
+	@brief Remove the watches of a stream.
+
+	Called by @ref FCB_decref when the last reference to an FCB with
+	watches is dropped, before the stream is closed.
+ */
+void event_forget(FCB* fcb);
+
+
+/** @} */
+
+#endif
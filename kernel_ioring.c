@@ -0,0 +1,246 @@
+#include "tinyos.h"
+#include "kernel_ioring.h"
+#include "kernel_cc.h"
+#include "kernel_dev.h"
+#include "kernel_poll.h"
+#include "kernel_sys.h"
+
+static int ioring_close(void *this);
+
+static file_ops ioring_ops = {
+	.Open = NULL,
+	.Read = NULL,
+	.Write = NULL,
+	.Close = ioring_close};
+
+/* The completions that the process has not taken. Called with the lock held */
+static unsigned int ioring_completions(io_ring_cb *cb)
+{
+	return cb->cq_tail - __atomic_load_n(&cb->ring->cq_head, __ATOMIC_ACQUIRE);
+}
+
+/* Post the completion of a submission. Called with the lock held */
+static void ioring_complete(io_ring_cb *cb, uintptr_t user_data, int result)
+{
+	cb->inflight--;
+	if (!cb->closed) // Else, the rings may be gone
+	{
+		cb->ring->cq[cb->cq_tail & (cb->entries - 1)] = (io_cqe_t){.user_data = user_data, .result = result};
+		cb->cq_tail++;
+		__atomic_store_n(&cb->ring->cq_tail, cb->cq_tail, __ATOMIC_RELEASE);
+	}
+	kernel_broadcast(&cb->completed);
+}
+
+/* Run a submission by its system call. It may wait */
+static int ioring_run(const io_sqe_t *e)
+{
+	switch (e->op)
+	{
+	case IO_READ:
+		return sys_Read(e->fd, e->buf, e->size);
+	case IO_WRITE:
+		return sys_Write(e->fd, e->buf, e->size);
+	case IO_ACCEPT:
+		return sys_Accept(e->fd);
+	case IO_CONNECT:
+		return sys_Connect(e->fd, e->port, e->timeout);
+	default:
+		return -1;
+	}
+}
+
+/*
+	Try to run a submission without waiting. Returns 1 and stores the result
+	if it is complete, or 0 if it needs a worker.
+*/
+static int ioring_try(const io_sqe_t *e, int *result)
+{
+	if (e->op != IO_READ && e->op != IO_WRITE)
+	{
+		*result = -1;
+		return e->op != IO_ACCEPT && e->op != IO_CONNECT; // Illegal operations fail at once
+	}
+
+	FCB *fcb = get_fcb_ref(e->fd);
+	if (fcb == NULL)
+	{
+		*result = -1;
+		return 1;
+	}
+
+	iovec_t iov = {e->buf, e->size};
+	*result = WOULD_BLOCK;
+	if (e->op == IO_READ && fcb->streamfunc->ReadV)
+		*result = fcb->streamfunc->ReadV(fcb->streamobj, &iov, 1, 1);
+	else if (e->op == IO_WRITE && fcb->streamfunc->WriteV)
+		*result = fcb->streamfunc->WriteV(fcb->streamobj, &iov, 1, 1);
+
+	// A worker would get WOULD_BLOCK too, in non-blocking mode
+	int done = (*result != WOULD_BLOCK) || fcb->nonblock;
+	FCB_decref(fcb);
+	return done;
+}
+
+static int ioring_worker(int argl, void *args)
+{
+	io_ring_cb *cb = (io_ring_cb *)args;
+
+	Mutex_Lock(&cb->lock);
+	while (!is_rlist_empty(&cb->pending))
+	{
+		io_request *req = rlist_pop_front(&cb->pending)->obj;
+		cb->npending--;
+		cb->busy++;
+		Mutex_Unlock(&cb->lock);
+
+		int result = ioring_run(&req->sqe);
+
+		Mutex_Lock(&cb->lock);
+		cb->busy--;
+		ioring_complete(cb, req->sqe.user_data, result);
+		free(req);
+	}
+
+	// No work left, the last one out after the close frees the ring
+	cb->workers--;
+	int last = cb->closed && cb->workers == 0;
+	Mutex_Unlock(&cb->lock);
+
+	if (last)
+		free(cb);
+	return 0;
+}
+
+/* Hand a submission to the workers. Called with the lock held */
+static void ioring_queue(io_ring_cb *cb, const io_sqe_t *e)
+{
+	io_request *req = (io_request *)xmalloc(sizeof(io_request));
+	req->sqe = *e;
+	rlnode_init(&req->node, req);
+	rlist_push_back(&cb->pending, &req->node);
+	cb->npending++;
+
+	// Start a worker, unless an idle one will take it
+	if (cb->workers - cb->busy < cb->npending && cb->workers < IORING_WORKERS)
+	{
+		// The new worker cannot take a request before we unlock
+		Tid_t t = sys_CreateThread(ioring_worker, 0, cb);
+		if (t != NOTHREAD)
+		{
+			cb->workers++;
+			sys_ThreadDetach(t);
+		}
+		else
+		{
+			// Without a worker for it, it fails at once
+			rlist_remove(&req->node);
+			cb->npending--;
+			ioring_complete(cb, req->sqe.user_data, -1);
+			free(req);
+		}
+	}
+}
+
+static int ioring_close(void *this)
+{
+	io_ring_cb *cb = (io_ring_cb *)this;
+
+	Mutex_Lock(&cb->lock);
+	cb->closed = 1;
+	int idle = (cb->workers == 0);
+	Mutex_Unlock(&cb->lock);
+
+	if (idle)
+		free(cb);
+	return 0;
+}
+
+Fid_t sys_IoRingSetup(io_ring_t *ring, unsigned int entries)
+{
+	if (ring == NULL || ring->sq == NULL || ring->cq == NULL)
+		return NOFILE;
+	if (entries == 0 || entries > MAX_IORING_ENTRIES || (entries & (entries - 1)) != 0)
+		return NOFILE;
+
+	Fid_t fid[1];
+	FCB *fcb[1];
+	if (!FCB_reserve(1, fid, fcb))
+		return NOFILE;
+
+	ring->entries = entries;
+	ring->sq_head = ring->sq_tail = 0;
+	ring->cq_head = ring->cq_tail = 0;
+
+	io_ring_cb *cb = (io_ring_cb *)xmalloc(sizeof(io_ring_cb));
+	cb->ring = ring;
+	cb->entries = entries;
+	cb->sq_head = 0;
+	cb->cq_tail = 0;
+	cb->lock = MUTEX_INIT;
+	rlnode_init(&cb->pending, NULL);
+	cb->npending = 0;
+	cb->inflight = 0;
+	cb->workers = 0;
+	cb->busy = 0;
+	cb->closed = 0;
+	cb->completed = COND_INIT;
+
+	fcb[0]->streamobj = cb;
+	fcb[0]->streamfunc = &ioring_ops;
+	return fid[0];
+}
+
+int sys_IoRingEnter(Fid_t ringfd, unsigned int min_complete, timeout_t timeout)
+{
+	// The reference keeps the ring open while we use it
+	FCB *fcb = get_fcb_ref(ringfd);
+	if (fcb == NULL)
+		return -1;
+	if (fcb->streamfunc != &ioring_ops)
+	{
+		FCB_decref(fcb);
+		return -1;
+	}
+
+	io_ring_cb *cb = fcb->streamobj;
+	io_ring_t *ring = cb->ring;
+	int submitted = 0;
+
+	Mutex_Lock(&cb->lock);
+
+	// Every submission taken must have room for its completion
+	unsigned int tail = __atomic_load_n(&ring->sq_tail, __ATOMIC_ACQUIRE);
+	while (cb->sq_head != tail && cb->inflight + ioring_completions(cb) < cb->entries)
+	{
+		io_sqe_t sqe = ring->sq[cb->sq_head & (cb->entries - 1)];
+		cb->sq_head++;
+		__atomic_store_n(&ring->sq_head, cb->sq_head, __ATOMIC_RELEASE);
+		cb->inflight++;
+		submitted++;
+		Mutex_Unlock(&cb->lock);
+
+		int result;
+		int done = ioring_try(&sqe, &result);
+
+		Mutex_Lock(&cb->lock);
+		if (done)
+			ioring_complete(cb, sqe.user_data, result);
+		else
+			ioring_queue(cb, &sqe);
+	}
+
+	// There cannot be more completions than entries
+	if (min_complete > cb->entries)
+		min_complete = cb->entries;
+
+	TimerDuration deadline = poll_deadline(timeout);
+	while (ioring_completions(cb) < min_complete && cb->inflight > 0)
+		if (!poll_sleep(&cb->lock, &cb->completed, deadline))
+			break;
+
+	Mutex_Unlock(&cb->lock);
+
+	FCB_decref(fcb);
+	return submitted;
+}
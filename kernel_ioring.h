@@ -0,0 +1,70 @@
+#ifndef __KERNEL_IORING_H
+#define __KERNEL_IORING_H
+
+#include "tinyos.h"
+#include "util.h"
+#include "kernel_streams.h"
+
+/**
+	@file kernel_ioring.h
+	@brief Asynchronous I/O rings.
+
+	@defgroup ioring I/O rings.
+	@ingroup kernel
+	@brief Asynchronous I/O rings.
+
+	An I/O ring is a stream whose object keeps the kernel side of the
+	rings of a process (see @c IoRingSetup). @c IoRingEnter takes the
+	queued submissions. Reads and writes are first tried without
+	waiting, through the @c ReadV and @c WriteV operations of the
+	stream; when this is not possible (or for accepts and connects),
+	the submission becomes a request, that a worker thread runs by the
+	ordinary system call.
+
+	Workers are threads of the process, created on demand up to
+	@c IORING_WORKERS, and they exit as soon as there are no requests.
+	Therefore, an idle I/O ring has no threads, and it does not keep
+	its process from exiting.
+
+	The ring object is freed when the stream is closed and the last
+	worker has exited. The rings of the process are not touched after
+	the stream is closed.
+
+	@{
+*/
+
+
+/** @brief The maximum number of worker threads of an I/O ring. */
+#define IORING_WORKERS 8
+
+
+/** @brief A submission waiting for a worker. */
+typedef struct io_request
+{
+	io_sqe_t sqe;			/**< @brief A copy of the submission */
+	rlnode node;			/**< @brief In the pending requests */
+} io_request;
+
+
+/** @brief The kernel side of an I/O ring. */
+typedef struct io_ring_cb
+{
+	io_ring_t* ring;		/**< @brief The rings of the process */
+	unsigned int entries;	/**< @brief The size of the rings */
+	unsigned int sq_head;	/**< @brief Our copy of @c ring->sq_head */
+	unsigned int cq_tail;	/**< @brief Our copy of @c ring->cq_tail */
+
+	Mutex lock;				/**< @brief Protects the fields below, and our side of the rings */
+	rlnode pending;			/**< @brief The requests that no worker has taken */
+	unsigned int npending;	/**< @brief The length of @c pending */
+	unsigned int inflight;	/**< @brief Submitted, and not yet completed */
+	unsigned int workers;	/**< @brief The worker threads */
+	unsigned int busy;		/**< @brief The workers running a request */
+	int closed;				/**< @brief Set when the stream is closed */
+	CondVar completed;		/**< @brief Signalled on every completion */
+} io_ring_cb;
+
+
+/** @} */
+
+#endif
@@ -1,28 +1,318 @@
 #include "tinyos.h"
 #include "kernel_pipe.h"
 #include "kernel_sched.h"
+#include "kernel_proc.h"
 #include "kernel_cc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
 
+static void *pipe_reader_get_pipe(void *this, int write) { return write ? NULL : this; }
+static void *pipe_writer_get_pipe(void *this, int write) { return write ? this : NULL; }
+static int pipe_reader_poll(void *this, poll_table *pt) { return pipe_poll(this, 0, pt); }
+static int pipe_writer_poll(void *this, poll_table *pt) { return pipe_poll(this, 1, pt); }
+
 file_ops reader_file_ops = {
 	.Open = NULL,
 	.Read = pipe_read,
 	.Write = nothingConst,
-	.Close = pipe_reader_close};
+	.Close = pipe_reader_close,
+	.GetPipe = pipe_reader_get_pipe,
+	.ReadV = pipe_readv,
+	.WriteV = nothingV,
+	.Poll = pipe_reader_poll};
 
 file_ops writer_file_ops = {
 	.Open = NULL,
 	.Read = nothing,
 	.Write = pipe_write,
-	.Close = pipe_writer_close};
+	.Close = pipe_writer_close,
+	.GetPipe = pipe_writer_get_pipe,
+	.ReadV = nothingV,
+	.WriteV = pipe_writev,
+	.Poll = pipe_writer_poll};
 
-int sys_Pipe(pipe_t *pipe)
+/* Copy n bytes from buf into the ring, at position pos (at most two memcpy calls) */
+static void pipe_copy_in(pipe_cb *pipeCB, uint pos, const char *buf, uint n)
+{
+	pos &= pipeCB->capacity - 1;
+	uint first = pipeCB->capacity - pos; // Room up to the end of the buffer
+	if (first > n)
+		first = n;
+	memcpy(pipeCB->buffer + pos, buf, first);
+	memcpy(pipeCB->buffer, buf + first, n - first);
+}
+
+/* Copy n bytes from the ring, at position pos, into buf (at most two memcpy calls) */
+static void pipe_copy_out(pipe_cb *pipeCB, uint pos, char *buf, uint n)
+{
+	pos &= pipeCB->capacity - 1;
+	uint first = pipeCB->capacity - pos; // Data up to the end of the buffer
+	if (first > n)
+		first = n;
+	memcpy(buf, pipeCB->buffer + pos, first);
+	memcpy(buf + first, pipeCB->buffer, n - first);
+}
+
+/* A position in the buffers of a vectored transfer */
+typedef struct iov_cursor
+{
+	const iovec_t *iov; // The current buffer
+	uint off;			// The bytes of the current buffer already done
+} iov_cursor;
+
+/* Copy n bytes from the buffers at cur into the ring, at position pos, advancing cur */
+static void pipe_copy_in_iov(pipe_cb *pipeCB, uint pos, iov_cursor *cur, uint n)
+{
+	while (n > 0)
+	{
+		uint len = cur->iov->len - cur->off;
+		if (len > n)
+			len = n;
+		pipe_copy_in(pipeCB, pos, cur->iov->buf + cur->off, len);
+		pos += len;
+		n -= len;
+		cur->off += len;
+		if (cur->off == cur->iov->len)
+		{
+			cur->iov++;
+			cur->off = 0;
+		}
+	}
+}
+
+/* Copy n bytes from the ring, at position pos, into the buffers at cur, advancing cur */
+static void pipe_copy_out_iov(pipe_cb *pipeCB, uint pos, iov_cursor *cur, uint n)
+{
+	while (n > 0)
+	{
+		uint len = cur->iov->len - cur->off;
+		if (len > n)
+			len = n;
+		pipe_copy_out(pipeCB, pos, cur->iov->buf + cur->off, len);
+		pos += len;
+		n -= len;
+		cur->off += len;
+		if (cur->off == cur->iov->len)
+		{
+			cur->iov++;
+			cur->off = 0;
+		}
+	}
+}
+
+/* The total size of the buffers (the caller has checked that it does not overflow) */
+static uint iov_size(const iovec_t *iov, uint iovcnt)
+{
+	uint size = 0;
+	for (uint i = 0; i < iovcnt; i++)
+		size += iov[i].len;
+	return size;
+}
+
+/* Atomic accessors for the fields that are read without the pipe lock */
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_SEQ_CST)
+#define STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_SEQ_CST)
+
+/* Lock/unlock all the locks of the pipe, in the right order */
+static void pipe_lock_all(pipe_cb *pipeCB)
+{
+	Mutex_Lock(&pipeCB->rlock);
+	Mutex_Lock(&pipeCB->wlock);
+	Mutex_Lock(&pipeCB->lock);
+}
+
+static void pipe_unlock_all(pipe_cb *pipeCB)
+{
+	Mutex_Unlock(&pipeCB->lock);
+	Mutex_Unlock(&pipeCB->wlock);
+	Mutex_Unlock(&pipeCB->rlock);
+}
+
+/* Signal a condition of the pipe, if anyone is waiting on it */
+static void pipe_wake(pipe_cb *pipeCB, uint *waiting, CondVar *cv)
+{
+	if (LOAD(*waiting) > 0)
+	{
+		Mutex_Lock(&pipeCB->lock);
+		kernel_signal(cv);
+		Mutex_Unlock(&pipeCB->lock);
+	}
+}
+
+/*
+The pipe memory lock protects the pipe_mem and pipe_list of every PCB, and the
+owner of every pipe. It is always locked after (inside) the lock of a pipe.
+*/
+static Mutex pipe_mem_lock = MUTEX_INIT;
+
+/*
+Charge a buffer of the given capacity of the pipe to pcb (or to the current owner,
+if pcb is NULL), instead of the current buffer. Fails if the process would go over
+MAX_PIPE_MEMORY. Called with the pipe lock held.
+*/
+static int pipe_charge(pipe_cb *pipeCB, PCB *pcb, uint capacity)
+{
+	int ok = 1;
+	Mutex_Lock(&pipe_mem_lock);
+
+	PCB *old = pipeCB->owner;
+	if (pcb == NULL)
+		pcb = old;
+
+	if (pcb != NULL)
+	{
+		size_t mem = pcb->pipe_mem - ((old == pcb) ? pipeCB->capacity : 0) + capacity;
+		if (mem > MAX_PIPE_MEMORY && (pcb != old || capacity > pipeCB->capacity))
+			ok = 0;
+	}
+
+	if (ok)
+	{
+		if (old != NULL)
+		{
+			old->pipe_mem -= pipeCB->capacity;
+			rlist_remove(&pipeCB->owner_node);
+		}
+		if (pcb != NULL && capacity > 0)
+		{
+			pcb->pipe_mem += capacity;
+			rlist_push_back(&pcb->pipe_list, &pipeCB->owner_node);
+		}
+		pipeCB->owner = (capacity > 0) ? pcb : NULL;
+	}
+
+	Mutex_Unlock(&pipe_mem_lock);
+	return ok;
+}
+
+void pipe_release_memory(PCB *pcb)
+{
+	Mutex_Lock(&pipe_mem_lock);
+	while (!is_rlist_empty(&pcb->pipe_list))
+	{
+		pipe_cb *pipeCB = rlist_pop_front(&pcb->pipe_list)->obj;
+		pipeCB->owner = NULL;
+	}
+	pcb->pipe_mem = 0;
+	Mutex_Unlock(&pipe_mem_lock);
+}
+
+/*
+Move the data of the pipe to a new buffer of the given capacity, charged to pcb
+(see pipe_charge). The capacity must be a power of 2, large enough for the data
+in the pipe. Called with all the locks of the pipe held.
+*/
+static int pipe_resize(pipe_cb *pipeCB, uint capacity, PCB *pcb)
+{
+	uint count = pipeCB->w_position - pipeCB->r_position;
+	assert(count <= capacity);
+
+	if (!pipe_charge(pipeCB, pcb, capacity))
+		return -1;
+
+	char *buffer = (char *)xmalloc(capacity);
+	pipe_copy_out(pipeCB, pipeCB->r_position, buffer, count);
+	free(pipeCB->buffer);
+
+	pipeCB->buffer = buffer;
+	pipeCB->capacity = capacity;
+	STORE(pipeCB->r_position, 0);
+	STORE(pipeCB->w_position, count);
+	pipeCB->pressure = 0;
+	pipeCB->idle = 0;
+	return 0;
+}
+
+/* Free the buffer, once both ends are closed. Called with all the locks of the pipe held */
+static void pipe_release_buffer(pipe_cb *pipeCB)
+{
+	if (pipeCB->buffer == NULL)
+		return;
+	pipe_charge(pipeCB, NULL, 0);
+	free(pipeCB->buffer);
+	pipeCB->buffer = NULL;
+	pipeCB->capacity = 0;
+}
+
+// Allocate and initialize a PipeCB with the given ends, charged to the current process
+pipe_cb *acquire_pipe_cb(pipe_t pit, int packet)
+{
+	pipe_cb *cb = (pipe_cb *)xmalloc(sizeof(pipe_cb));
+	cb->pit = pit;
+	cb->packet = packet;
+	cb->buffer = (char *)xmalloc(PIPE_BUFFER_SIZE);
+	cb->capacity = PIPE_BUFFER_SIZE;
+	cb->min_capacity = PIPE_BUFFER_SIZE;
+	cb->r_position = 0;
+	cb->w_position = 0;
+	cb->pressure = 0;
+	cb->idle = 0;
+	cb->readers_waiting = 0;
+	cb->writers_waiting = 0;
+	cb->space_wanted = 0;
+	cb->has_space = COND_INIT;
+	cb->has_data = COND_INIT;
+	cb->lock = MUTEX_INIT;
+	cb->rlock = MUTEX_INIT;
+	cb->wlock = MUTEX_INIT;
+	poll_queue_init(&cb->pollq);
+	cb->owner = NULL;
+	rlnode_init(&cb->owner_node, cb);
+
+	/* The initial buffer is always charged, even over the limit */
+	pipe_set_owner(cb, CURPROC);
+	return cb;
+}
+
+// Charge the buffer of a pipe to pcb (or to nobody), even over the limit
+void pipe_set_owner(pipe_cb *cb, PCB *pcb)
+{
+	Mutex_Lock(&pipe_mem_lock);
+	if (cb->owner != NULL)
+	{
+		cb->owner->pipe_mem -= cb->capacity;
+		rlist_remove(&cb->owner_node);
+	}
+	if (cb->buffer == NULL)
+		pcb = NULL;
+	if (pcb != NULL)
+	{
+		pcb->pipe_mem += cb->capacity;
+		rlist_push_back(&pcb->pipe_list, &cb->owner_node);
+	}
+	cb->owner = pcb;
+	Mutex_Unlock(&pipe_mem_lock);
+}
+
+// Make a PipeCB with both ends closed ready for use again, with new ends
+void pipe_reset(pipe_cb *cb, pipe_t pit)
+{
+	if (cb->buffer == NULL)
+	{
+		// Charged by the caller, see pipe_set_owner()
+		cb->buffer = (char *)xmalloc(PIPE_BUFFER_SIZE);
+		cb->capacity = PIPE_BUFFER_SIZE;
+	}
+	cb->pit = pit;
+	cb->min_capacity = PIPE_BUFFER_SIZE;
+	cb->r_position = 0;
+	cb->w_position = 0;
+	cb->pressure = 0;
+	cb->idle = 0;
+}
+
+// Free a PipeCB that nobody uses any more
+void release_pipe_cb(pipe_cb *cb)
+{
+	pipe_release_buffer(cb);
+	free(cb);
+}
+
+static int create_pipe(pipe_t *pipe, int packet)
 {
 	// We create local variables for FIDT, FCB and PipeCB
 	Fid_t fid[2];
 	FCB *fcb[2];
-	pipe_cb *cb = (pipe_cb *)xmalloc(sizeof(pipe_cb));
 
 	// We reserve 2 FCBs
 	int reservedFCB = FCB_reserve(2, fid, fcb);
@@ -36,11 +326,7 @@ int sys_Pipe(pipe_t *pipe)
 	pipe->write = fid[1];
 
 	// Initialize the PipeCB content
-	cb->pit = *pipe;
-	cb->r_position = 0;
-	cb->w_position = 0;
-	cb->has_space = COND_INIT;
-	cb->has_data = COND_INIT;
+	pipe_cb *cb = acquire_pipe_cb(*pipe, packet);
 
 	// Common PipeCB for the read/write FCBs
 	fcb[0]->streamobj = cb;
@@ -52,49 +338,249 @@ int sys_Pipe(pipe_t *pipe)
 	return 0;
 }
 
-int pipe_write(void *pipecb_t, const char *buf, unsigned int size)
+int sys_Pipe(pipe_t *pipe)
 {
-	pipe_cb *pipeCB = (pipe_cb *)pipecb_t;
+	return create_pipe(pipe, 0);
+}
 
-	// If the pipe isn't valid, it fails
-	if (pipeCB == NULL)
+int sys_PacketPipe(pipe_t *pipe)
+{
+	return create_pipe(pipe, 1);
+}
+
+/*
+The data path of a pipe.
+
+A pipe is a ring with one reading position and one writing position. Readers
+serialize on rlock and only move r_position, writers serialize on wlock and
+only move w_position, and each side reads the position of the other side
+atomically. Therefore, with one reader and one writer (the common case) the
+transfer never contends on a lock.
+
+The pipe lock is only taken to sleep and to wake up. A thread that is about to
+sleep increments its waiting counter under the pipe lock and then checks the
+positions again; the other side moves its position and then checks the
+counter. Since both use sequentially consistent atomics, at least one of them
+sees the other, so a wakeup cannot be lost.
+
+Resizing and closing take all three locks (rlock, wlock, then lock). Nobody
+holds rlock or wlock while sleeping.
+*/
+
+/*
+Sleep until need bytes fit in the pipe, or an end is closed, or the buffer is
+resized. Returns 1 if it slept. Called with wlock held
+*/
+static int pipe_wait_space(pipe_cb *pipeCB, uint need)
+{
+	int slept = 0;
+	Mutex_Unlock(&pipeCB->wlock);
+	Mutex_Lock(&pipeCB->lock);
+
+	// There is no room for us, let a reader know before we sleep
+	if (pipeCB->readers_waiting > 0)
+		kernel_signal(&(pipeCB->has_data));
+
+	// We ask to be woken up at the low watermark, or when all we need fits
+	uint wanted = PIPE_LOW_WATERMARK(pipeCB->capacity);
+	if (need < wanted)
+		wanted = need;
+	if (pipeCB->writers_waiting == 0 || wanted < pipeCB->space_wanted)
+		STORE(pipeCB->space_wanted, wanted);
+
+	// The capacity cannot change while we hold the pipe lock
+	STORE(pipeCB->writers_waiting, pipeCB->writers_waiting + 1);
+	if (LOAD(pipeCB->pit.read) != NOFILE && LOAD(pipeCB->pit.write) != NOFILE && need <= pipeCB->capacity &&
+		pipeCB->capacity - (LOAD(pipeCB->w_position) - LOAD(pipeCB->r_position)) < need)
 	{
-		return -1;
+		kernel_wait(&pipeCB->lock, &(pipeCB->has_space), SCHED_PIPE);
+		slept = 1;
 	}
+	STORE(pipeCB->writers_waiting, pipeCB->writers_waiting - 1);
 
-	// If any end of the pipe is closed, it also fails
-	if (pipeCB->pit.write == NOFILE || pipeCB->pit.read == NOFILE)
+	Mutex_Unlock(&pipeCB->lock);
+	Mutex_Lock(&pipeCB->wlock);
+	return slept;
+}
+
+/* Sleep until the pipe is not empty or an end is closed. Called with rlock held */
+static void pipe_wait_data(pipe_cb *pipeCB)
+{
+	Mutex_Unlock(&pipeCB->rlock);
+	Mutex_Lock(&pipeCB->lock);
+
+	STORE(pipeCB->readers_waiting, pipeCB->readers_waiting + 1);
+	if (LOAD(pipeCB->pit.read) != NOFILE && LOAD(pipeCB->pit.write) != NOFILE &&
+		LOAD(pipeCB->w_position) == LOAD(pipeCB->r_position))
+		kernel_wait(&pipeCB->lock, &(pipeCB->has_data), SCHED_PIPE);
+	STORE(pipeCB->readers_waiting, pipeCB->readers_waiting - 1);
+
+	Mutex_Unlock(&pipeCB->lock);
+	Mutex_Lock(&pipeCB->rlock);
+}
+
+/*
+Wait until the pipe has at least need bytes of space (returns 1), or an end is
+closed (returns 0), or the buffer is smaller than need (returns -1). If nonblock
+is set, it returns WOULD_BLOCK instead of waiting. Called with wlock held; on 
+return *w is the writing position. Under sustained backpressure the buffer grows
+instead.
+*/
+static int pipe_await_space(pipe_cb *pipeCB, uint need, uint *w, int nonblock)
+{
+	// Pressure is finding no room on the first try, or again after a wakeup
+	int pressed = 1;
+
+	for (;;)
 	{
+		// If any end of the pipe is closed, we stop
+		if (LOAD(pipeCB->pit.write) == NOFILE || LOAD(pipeCB->pit.read) == NOFILE)
+			return 0;
+
+		// The buffer may also have shrunk while we were sleeping
+		if (need > pipeCB->capacity)
+			return -1;
+
+		*w = pipeCB->w_position;
+		uint space = pipeCB->capacity - (*w - LOAD(pipeCB->r_position));
+		if (space >= need)
+			return 1;
+
+		__atomic_store_n(&pipeCB->idle, 0, __ATOMIC_RELAXED);
+
+		// Under sustained backpressure, try to grow the buffer instead of waiting.
+		// We already hold wlock, so we must not block on rlock.
+		if (pressed && ++pipeCB->pressure >= PIPE_GROW_PRESSURE && pipeCB->capacity < PIPE_GROW_MAX &&
+			Mutex_TryLock(&pipeCB->rlock))
+		{
+			Mutex_Lock(&pipeCB->lock);
+			int grown = (pipe_resize(pipeCB, pipeCB->capacity * 2, CURPROC) == 0);
+			Mutex_Unlock(&pipeCB->lock);
+			Mutex_Unlock(&pipeCB->rlock);
+			if (grown)
+				continue;
+		}
+
+		if (nonblock)
+			return WOULD_BLOCK;
+		pressed = pipe_wait_space(pipeCB, need);
+	}
+}
+
+/* Wake up the waiters after a write. Called with wlock held */
+static void pipe_write_done(pipe_cb *pipeCB)
+{
+	// Let a reader know we wrote something (only readers of an empty pipe wait)
+	pipe_wake(pipeCB, &pipeCB->readers_waiting, &pipeCB->has_data);
+	// If there is still space, pass it on to the next writer
+	if (pipeCB->w_position - LOAD(pipeCB->r_position) < pipeCB->capacity)
+		pipe_wake(pipeCB, &pipeCB->writers_waiting, &pipeCB->has_space);
+	poll_notify(&pipeCB->pollq);
+}
+
+/* Write a whole message, preceded by its length */
+static int pipe_write_packet(pipe_cb *pipeCB, iov_cursor *cur, unsigned int size, int nonblock)
+{
+	if (size == 0)
+		return 0;
+	if (size > MAX_PIPE_CAPACITY - sizeof(uint))
 		return -1;
+
+	uint need = size + sizeof(uint);
+	uint w;
+	int rc;
+
+	Mutex_Lock(&pipeCB->wlock);
+
+	while ((rc = pipe_await_space(pipeCB, need, &w, nonblock)) != 1)
+	{
+		if (rc == WOULD_BLOCK)
+		{
+			Mutex_Unlock(&pipeCB->wlock);
+			return WOULD_BLOCK;
+		}
+
+		// The message must fit in the buffer as a whole, so grow it first
+		int ok = 0;
+		if (rc == -1)
+		{
+			uint newcap = pipeCB->capacity;
+			while (newcap < need)
+				newcap <<= 1;
+
+			Mutex_Unlock(&pipeCB->wlock);
+			pipe_lock_all(pipeCB);
+			ok = (pipeCB->buffer != NULL) &&
+				 (newcap <= pipeCB->capacity || pipe_resize(pipeCB, newcap, CURPROC) == 0);
+			Mutex_Unlock(&pipeCB->lock);
+			Mutex_Unlock(&pipeCB->rlock);
+		}
+		if (!ok)
+		{
+			Mutex_Unlock(&pipeCB->wlock);
+			return -1;
+		}
 	}
 
-	int place = 0;
+	pipe_copy_in(pipeCB, w, (const char *)&size, sizeof(uint));
+	pipe_copy_in_iov(pipeCB, w + sizeof(uint), cur, size);
+	STORE(pipeCB->w_position, w + need);
+
+	pipe_write_done(pipeCB);
+	Mutex_Unlock(&pipeCB->wlock);
+	return size;
+}
 
-	// If pointer w_position reaches pointer r_position change CondVar has_space to sleep
-	while ((pipeCB->w_position + 1) % PIPE_BUFFER_SIZE == pipeCB->r_position && pipeCB->pit.read != NOFILE)
+/* Write size bytes from the buffers of iov */
+static int pipe_write_iov(pipe_cb *pipeCB, const iovec_t *iov, unsigned int size, int nonblock)
+{
+	// If the pipe isn't valid, it fails
+	if (pipeCB == NULL)
 	{
-		kernel_wait(&(pipeCB->has_space), SCHED_PIPE);
+		return -1;
 	}
 
-	// Here we write to the pipe
-	while (place != size && place < PIPE_BUFFER_SIZE)
+	iov_cursor cur = {iov, 0};
+
+	if (pipeCB->packet)
+		return pipe_write_packet(pipeCB, &cur, size, nonblock);
+
+	Mutex_Lock(&pipeCB->wlock);
+
+	unsigned int place = 0;
+	uint w;
+	int rc = 0;
+
+	// Here we write to the pipe, as much as fits each time, until everything is written
+	while (place != size && (rc = pipe_await_space(pipeCB, 1, &w, nonblock)) == 1)
 	{
-		// If the writer tries to overwrite data that hasn't been read yet, we break out of the loop
-		if ((pipeCB->w_position + 1) % PIPE_BUFFER_SIZE == pipeCB->r_position && pipeCB->pit.read != NOFILE)
-			break;
-		/*We write the character of the buffer we want to write in place "place"
-		to the place where pointer w_position is on our pipe buffer*/
-		pipeCB->buffer[pipeCB->w_position] = buf[place];
-		// Increase the pointer w_position
-		pipeCB->w_position = (pipeCB->w_position + 1) % PIPE_BUFFER_SIZE;
-		// Increase our local counter
-		place++;
-	}
-	// Let the others know we wrote something
-	kernel_broadcast(&(pipeCB->has_data));
+		uint space = pipeCB->capacity - (w - LOAD(pipeCB->r_position));
+		uint n = (size - place < space) ? size - place : space;
+		pipe_copy_in_iov(pipeCB, w, &cur, n);
+		STORE(pipeCB->w_position, w + n);
+		place += n;
+	}
+
+	if (place > 0)
+		pipe_write_done(pipeCB);
+
+	Mutex_Unlock(&pipeCB->wlock);
+	if (place == 0 && size > 0)
+		return (rc == WOULD_BLOCK) ? WOULD_BLOCK : -1;
 	return place;
 }
 
+int pipe_write(void *pipecb_t, const char *buf, unsigned int size)
+{
+	iovec_t iov = {(char *)buf, size};
+	return pipe_write_iov((pipe_cb *)pipecb_t, &iov, size, 0);
+}
+
+int pipe_writev(void *pipecb_t, const iovec_t *iov, unsigned int iovcnt, int nonblock)
+{
+	return pipe_write_iov((pipe_cb *)pipecb_t, iov, iov_size(iov, iovcnt), nonblock);
+}
+
 int nothing(void *pipecb_t, char *buf, unsigned int size)
 {
 	return -1;
@@ -105,99 +591,352 @@ int nothingConst(void *pipecb_t, const char *buf, unsigned int size)
 	return -1;
 }
 
-int pipe_read(void *pipecb_t, char *buf, unsigned int size)
+int nothingV(void *pipecb_t, const iovec_t *iov, unsigned int iovcnt, int nonblock)
 {
-	pipe_cb *pipeCB = (pipe_cb *)pipecb_t;
+	return -1;
+}
+
+/*
+Wait until the pipe has data, or the writer end is closed (then *count may be 0).
+Returns 0 if the reader end is closed, and WOULD_BLOCK if it would wait but nonblock
+is set. Called with rlock held; on return *r is the reading position and *count 
+the bytes in the pipe.
+*/
+static int pipe_await_data(pipe_cb *pipeCB, uint *r, uint *count, int nonblock)
+{
+	for (;;)
+	{
+		// If reader end of pipe is closed, it fails
+		if (LOAD(pipeCB->pit.read) == NOFILE)
+			return 0;
+
+		*r = pipeCB->r_position;
+		*count = LOAD(pipeCB->w_position) - *r;
+		if (*count > 0)
+			return 1;
+
+		// If the writer end is closed, we read till the end of the data
+		if (LOAD(pipeCB->pit.write) == NOFILE)
+		{
+			*count = LOAD(pipeCB->w_position) - *r;
+			return 1;
+		}
+
+		// The pipe is empty, sleep until there is data or the writer end is closed
+		__atomic_store_n(&pipeCB->pressure, 0, __ATOMIC_RELAXED);
 
+		// When the pipe stays idle, give back the memory of an automatically grown buffer
+		if (++pipeCB->idle >= PIPE_SHRINK_IDLE && pipeCB->capacity > pipeCB->min_capacity)
+		{
+			Mutex_Lock(&pipeCB->wlock);
+			Mutex_Lock(&pipeCB->lock);
+			if (LOAD(pipeCB->w_position) == pipeCB->r_position)
+				pipe_resize(pipeCB, pipeCB->min_capacity, NULL);
+			Mutex_Unlock(&pipeCB->lock);
+			Mutex_Unlock(&pipeCB->wlock);
+		}
+
+		if (nonblock)
+			return WOULD_BLOCK;
+		pipe_wait_data(pipeCB);
+	}
+}
+
+/* Move the reading position to r, and wake up the waiters. Called with rlock held */
+static void pipe_read_done(pipe_cb *pipeCB, uint r)
+{
+	STORE(pipeCB->r_position, r);
+
+	// Wake up a writer, once there is enough space for it
+	uint space = pipeCB->capacity - (LOAD(pipeCB->w_position) - r);
+	if (space >= LOAD(pipeCB->space_wanted))
+		pipe_wake(pipeCB, &pipeCB->writers_waiting, &pipeCB->has_space);
+	// If there is still data, pass it on to the next reader
+	if (space < pipeCB->capacity)
+		pipe_wake(pipeCB, &pipeCB->readers_waiting, &pipeCB->has_data);
+	poll_notify(&pipeCB->pollq);
+}
+
+/*
+Move up to size bytes from the ring of src to the ring of dst, with one copy. Like
+a read, it waits for some data, and it moves what is there (waiting for space in
+dst as needed). It returns what it moved, 0 at the end of the data, or -1 if an
+end is closed before anything is moved. Both pipes must be in stream mode.
+
+We wait for space in dst holding only its wlock, and for data in src holding only
+its rlock. With rlock of src held, wlock of dst is only tried, so two splices in
+opposite directions cannot deadlock.
+*/
+int pipe_await_room(pipe_cb *cb, unsigned int size)
+{
+	uint header = cb->packet ? sizeof(uint) : 0;
+	uint w;
+	int rc;
+
+	Mutex_Lock(&cb->wlock);
+	do
+	{
+		// What does not fit in the buffer is cut (the buffer may shrink while we wait)
+		if (size + header > cb->capacity)
+			size = cb->capacity - header;
+		rc = pipe_await_space(cb, size + header, &w, 0);
+	} while (rc == -1);
+	Mutex_Unlock(&cb->wlock);
+
+	return rc ? (int)size : 0;
+}
+
+int pipe_splice(pipe_cb *src, pipe_cb *dst, unsigned int size)
+{
+	uint moved = 0;
+
+	while (moved < size)
+	{
+		uint w, r, count;
+
+		Mutex_Lock(&dst->wlock);
+		int rc = pipe_await_space(dst, 1, &w, 0);
+		Mutex_Unlock(&dst->wlock);
+		if (rc != 1)
+			break;
+
+		Mutex_Lock(&src->rlock);
+		if (moved == 0)
+		{
+			if (!pipe_await_data(src, &r, &count, 0))
+			{
+				Mutex_Unlock(&src->rlock);
+				break;
+			}
+		}
+		else
+		{
+			// Once we have moved something, we only take what is there
+			r = src->r_position;
+			count = (LOAD(src->pit.read) == NOFILE) ? 0 : LOAD(src->w_position) - r;
+		}
+		if (count == 0)
+		{
+			Mutex_Unlock(&src->rlock);
+			return moved;
+		}
+
+		if (!Mutex_TryLock(&dst->wlock))
+		{
+			Mutex_Unlock(&src->rlock);
+			continue;
+		}
+
+		if (LOAD(dst->pit.write) == NOFILE || LOAD(dst->pit.read) == NOFILE)
+		{
+			Mutex_Unlock(&dst->wlock);
+			Mutex_Unlock(&src->rlock);
+			break;
+		}
+
+		// Others may have filled dst in the meantime
+		w = dst->w_position;
+		uint space = dst->capacity - (w - LOAD(dst->r_position));
+		uint n = (size - moved < count) ? size - moved : count;
+		if (n > space)
+			n = space;
+
+		if (n > 0)
+		{
+			// The data of src is at most two pieces, up to its end and from its start
+			uint pos = r & (src->capacity - 1);
+			uint first = src->capacity - pos;
+			if (first > n)
+				first = n;
+			pipe_copy_in(dst, w, src->buffer + pos, first);
+			pipe_copy_in(dst, w + first, src->buffer, n - first);
+			STORE(dst->w_position, w + n);
+			pipe_write_done(dst);
+		}
+		Mutex_Unlock(&dst->wlock);
+
+		if (n > 0)
+			pipe_read_done(src, r + n);
+		Mutex_Unlock(&src->rlock);
+		moved += n;
+	}
+
+	return (moved > 0 || size == 0) ? (int)moved : -1;
+}
+
+/* Read up to size bytes into the buffers of iov */
+static int pipe_read_iov(pipe_cb *pipeCB, const iovec_t *iov, unsigned int size, int nonblock)
+{
 	// If the pipe isn't valid, it fails
 	if (pipeCB == NULL)
 	{
 		return -1;
 	}
 
-	// If reader end of pipe is closed, it fails
-	if (pipeCB->pit.read == NOFILE)
+	Mutex_Lock(&pipeCB->rlock);
+
+	uint r, count;
+	int rc = pipe_await_data(pipeCB, &r, &count, nonblock);
+	if (rc != 1)
 	{
-		return -1;
+		Mutex_Unlock(&pipeCB->rlock);
+		return (rc == WOULD_BLOCK) ? WOULD_BLOCK : -1;
 	}
 
-	int place = 0;
-
-	// If the writer end is closed, read till the end of the data
-	if (pipeCB->pit.write == NOFILE)
+	iov_cursor cur = {iov, 0};
+	uint n;
+	if (pipeCB->packet)
 	{
-		while (pipeCB->r_position < pipeCB->w_position)
+		// Read the next message, dropping whatever does not fit in buf
+		uint len = 0;
+		if (count > 0)
 		{
-			if (place == size)
-				return place;
-			buf[place] = pipeCB->buffer[pipeCB->r_position];
-			pipeCB->r_position = (pipeCB->r_position + 1) % PIPE_BUFFER_SIZE;
-			place++;
+			pipe_copy_out(pipeCB, r, (char *)&len, sizeof(uint));
+			n = (size < len) ? size : len;
+			pipe_copy_out_iov(pipeCB, r + sizeof(uint), &cur, n);
+			pipe_read_done(pipeCB, r + sizeof(uint) + len);
 		}
-		return place;
+		else
+			n = 0;
 	}
-
-	// If pointer r_position reaches the place of pointer w_position change CondVar has_data to sleep
-	while (pipeCB->r_position == pipeCB->w_position && pipeCB->pit.write != NOFILE)
+	else
 	{
-		kernel_wait(&(pipeCB->has_data), SCHED_PIPE);
+		// Here we read the pipe
+		n = (size < count) ? size : count;
+		pipe_copy_out_iov(pipeCB, r, &cur, n);
+		if (n > 0)
+			pipe_read_done(pipeCB, r + n);
 	}
 
-	// Here we read the pipe
-	while (place != size && place < PIPE_BUFFER_SIZE)
+	Mutex_Unlock(&pipeCB->rlock);
+	return n;
+}
+
+int pipe_read(void *pipecb_t, char *buf, unsigned int size)
+{
+	iovec_t iov = {buf, size};
+	return pipe_read_iov((pipe_cb *)pipecb_t, &iov, size, 0);
+}
+
+int pipe_readv(void *pipecb_t, const iovec_t *iov, unsigned int iovcnt, int nonblock)
+{
+	return pipe_read_iov((pipe_cb *)pipecb_t, iov, iov_size(iov, iovcnt), nonblock);
+}
+
+int pipe_poll(pipe_cb *cb, int write, poll_table *pt)
+{
+	poll_wait(pt, &cb->pollq);
+
+	// The positions are read after the registration, so a transfer after them notifies us
+	uint count = LOAD(cb->w_position) - LOAD(cb->r_position);
+	if (write)
 	{
-		// If the reader tries to read something not yet written, we break out of the loop
-		if (pipeCB->r_position == pipeCB->w_position)
-			break;
-		buf[place] = pipeCB->buffer[pipeCB->r_position];
-		pipeCB->r_position = (pipeCB->r_position + 1) % PIPE_BUFFER_SIZE;
-		place++;
+		// A write fails once either end is closed (a socket may shut down its own end)
+		if (LOAD(cb->pit.read) == NOFILE || LOAD(cb->pit.write) == NOFILE)
+			return POLL_ERROR;
+		return (count < LOAD(cb->capacity)) ? POLL_WRITE : 0;
+	}
+	else
+	{
+		if (LOAD(cb->pit.read) == NOFILE)
+			return POLL_ERROR;
+		if (LOAD(cb->pit.write) == NOFILE)
+			return POLL_READ | POLL_HANGUP;
+		return (count > 0) ? POLL_READ : 0;
 	}
-	kernel_broadcast(&(pipeCB->has_space));
-	return place;
 }
 
-int pipe_writer_close(void *_pipecb)
+/*
+Close one end of the pipe, freeing the buffer when both are closed. Unless a
+socket owns the pipe (keep is set), the PipeCB is freed too.
+*/
+static int pipe_close_end(pipe_cb *pipeCB, Fid_t *end, int keep)
 {
-	pipe_cb *pipeCB = (pipe_cb *)_pipecb;
+	if (pipeCB == NULL)
+		return -1;
 
-	if (pipeCB != NULL)
-	{
-		pipeCB->pit.write = NOFILE;
+	pipe_lock_all(pipeCB);
+	STORE(*end, NOFILE);
 
-		if (pipeCB->pit.read == NOFILE)
-		{
-			pipeCB = NULL;
-			free(pipeCB);
-		}
-		else
-		{
-			kernel_broadcast(&(pipeCB->has_data));
-		}
-		return 0;
+	int closed = (pipeCB->pit.read == NOFILE && pipeCB->pit.write == NOFILE);
+	if (closed)
+		pipe_release_buffer(pipeCB);
+	else
+	{
+		// Everyone waiting must notice
+		kernel_broadcast(&(pipeCB->has_data));
+		kernel_broadcast(&(pipeCB->has_space));
 	}
-	return -1;
+	// Before we unlock, else the other end may free the pipe under us
+	poll_notify(&pipeCB->pollq);
+	pipe_unlock_all(pipeCB);
+
+	// Nobody else can reach it now
+	if (closed && !keep)
+		release_pipe_cb(pipeCB);
+	return 0;
+}
+
+int pipe_writer_close(void *_pipecb)
+{
+	pipe_cb *pipeCB = (pipe_cb *)_pipecb;
+	return pipe_close_end(pipeCB, pipeCB ? &pipeCB->pit.write : NULL, 0);
 }
 
 int pipe_reader_close(void *_pipecb)
 {
 	pipe_cb *pipeCB = (pipe_cb *)_pipecb;
+	return pipe_close_end(pipeCB, pipeCB ? &pipeCB->pit.read : NULL, 0);
+}
 
-	if (pipeCB != NULL)
+int pipe_shutdown_writer(pipe_cb *cb)
+{
+	return pipe_close_end(cb, cb ? &cb->pit.write : NULL, 1);
+}
+
+int pipe_shutdown_reader(pipe_cb *cb)
+{
+	return pipe_close_end(cb, cb ? &cb->pit.read : NULL, 1);
+}
+
+int sys_SetPipeCapacity(Fid_t fd, unsigned int capacity)
+{
+	if (capacity > MAX_PIPE_CAPACITY)
+		return -1;
+
+	FCB *fcb = get_fcb_ref(fd);
+	if (fcb == NULL)
+		return -1;
+
+	// It must be either end of a pipe
+	if (fcb->streamfunc != &reader_file_ops && fcb->streamfunc != &writer_file_ops)
 	{
-		pipeCB->pit.read = NOFILE;
+		FCB_decref(fcb);
+		return -1;
+	}
 
-		if (pipeCB->pit.write == NOFILE)
-		{
-			pipeCB = NULL;
-			free(pipeCB);
-		}
-		else
-		{
+	// Round up to a power of 2
+	uint newcap = PIPE_BUFFER_SIZE;
+	while (newcap < capacity)
+		newcap <<= 1;
+
+	pipe_cb *pipeCB = (pipe_cb *)fcb->streamobj;
+	int ret = -1;
+
+	pipe_lock_all(pipeCB);
+	// The data in the pipe must fit in the new buffer
+	if (pipeCB->buffer != NULL && pipeCB->w_position - pipeCB->r_position <= newcap &&
+		pipe_resize(pipeCB, newcap, CURPROC) == 0)
+	{
+		pipeCB->min_capacity = newcap;
+		// The writers may have more space now
+		if (pipeCB->writers_waiting > 0)
 			kernel_broadcast(&(pipeCB->has_space));
-		}
-		return 0;
+		ret = newcap;
 	}
+	pipe_unlock_all(pipeCB);
+	poll_notify(&pipeCB->pollq);
 
-	return -1;
+	FCB_decref(fcb);
+	return ret;
 }
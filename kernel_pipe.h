@@ -1,6 +1,7 @@
 #include "tinyos.h"
 #include "util.h"
 #include "kernel_dev.h"
+#include "kernel_poll.h"
 
 /*
 Every PCB has an FIDT list inside it, with the max number of FIDs being 16.
@@ -11,29 +12,107 @@ We need 2 FIDs and 2 FCBs, which are initialized to be pointing to the pipe
 readers and writers.
 
 We have a buffer in our pipe, containing our data, which is a bounded (cyclic) byte buffer.
-Its max size is by choice 4096 Bytes, the default page size of Linux :)
+Its initial size is by choice 4096 Bytes, the default page size of Linux :)
+The buffer is resized with SetPipeCapacity(), and it also grows by itself when the
+writer keeps finding no room for its writes, and shrinks back when the reader keeps finding it empty.
+The buffer memory is charged to the process that last resized it (or created it).
+The pipes of sockets are charged as described in kernel_socket.h.
+
+The positions are free-running counters: they are only ever incremented, and 
+w_position - r_position is the number of bytes in the buffer (this also works
+when they wrap around). In packet mode (see PacketPipe()), every write is stored as an unsigned length
+followed by the bytes of the message, and every read takes exactly one message.
+
+Since the capacity is a power of 2, the place of a position
+in the buffer is (position & (capacity - 1)), and a transfer is done with at
+most two memcpy calls, one up to the end of the buffer and one from its start.
+*/
+
+#define PIPE_BUFFER_SIZE 4096 /* The initial (and smallest) capacity */
+
+#define PIPE_GROW_MAX (1024 * 1024) /* Automatic growth stops at this capacity */
+#define PIPE_GROW_PRESSURE 4 /* Grow after the writer finds no room for its write this many times in a row */
+#define PIPE_SHRINK_IDLE 64 /* Shrink after the reader finds the pipe empty this many times in a row */
+
+/*
+Waiting writers are woken when the free space reaches the low watermark (or what 
+they need, if less). Readers only wait on an empty pipe, and they are woken once
+a write is done, or when it has filled the pipe (our high watermark).
 */
+#define PIPE_LOW_WATERMARK(capacity) ((capacity) / 4)
 
-#define PIPE_BUFFER_SIZE 4096
+_Static_assert((PIPE_BUFFER_SIZE & (PIPE_BUFFER_SIZE - 1)) == 0, "PIPE_BUFFER_SIZE must be a power of 2");
 
 typedef struct pipe_control_block
 {
 	pipe_t pit;
-	char buffer[PIPE_BUFFER_SIZE];
-	uint r_position;
-	uint w_position;
+	int packet;		   /* In packet mode, each write is stored as one message: its length, then its bytes */
+	char *buffer;	   /* NULL once both ends are closed */
+	uint capacity;	   /* The size of buffer, a power of 2 */
+	uint min_capacity; /* The capacity set by SetPipeCapacity(), we never shrink below it */
+	uint r_position;   /* Total bytes read from the pipe */
+	uint w_position;   /* Total bytes written to the pipe */
+	uint pressure;	   /* Consecutive times the writer found no room for its write */
+	uint idle;		   /* Consecutive times the reader found the pipe empty */
+	uint readers_waiting; /* Threads waiting on has_data */
+	uint writers_waiting; /* Threads waiting on has_space */
+	uint space_wanted;	  /* The free space a waiting writer needs to make progress */
 	CondVar has_space;
 	CondVar has_data;
+	Mutex lock;	 /* Taken to sleep and wake up, has_space and has_data are waited on with it */
+	Mutex rlock; /* Serializes the readers */
+	Mutex wlock; /* Serializes the writers */
+	poll_queue pollq; /* The threads polling either end, notified after every transfer */
+
+	PCB *owner;		   /* The process charged for buffer, protected by the pipe memory lock */
+	rlnode owner_node; /* Node in the owner's pipe_list */
 } pipe_cb;
 
+pipe_cb *acquire_pipe_cb(pipe_t pit, int packet);
+
+/* Reuse a pipe whose ends are both closed, with the given ends. Nobody else may be using it.
+   A new buffer is not charged to any process */
+void pipe_reset(pipe_cb *cb, pipe_t pit);
+/* Charge the buffer of a pipe to a process, or to none if pcb is NULL, even over the limit.
+   Nobody else may be using the pipe */
+void pipe_set_owner(pipe_cb *cb, PCB *pcb);
+
+/* Free a pipe that nobody references any more */
+void release_pipe_cb(pipe_cb *cb);
+
+/* Stop charging a process for any pipes it still has buffers charged to. Called when the process exits */
+void pipe_release_memory(PCB *pcb);
+
 int nothing(void *this, char *buf, unsigned int size);
 
 int nothingConst(void *this, const char *buf, unsigned int size);
 
+int nothingV(void *this, const iovec_t *iov, unsigned int iovcnt, int nonblock);
+
 int pipe_read(void *this, char *buf, unsigned int size);
 
 int pipe_write(void *this, const char *buf, unsigned int size);
 
+/* Vectored read and write, a single transfer (or message) for all the buffers, see ReadV() */
+int pipe_readv(void *this, const iovec_t *iov, unsigned int iovcnt, int nonblock);
+
+int pipe_writev(void *this, const iovec_t *iov, unsigned int iovcnt, int nonblock);
+
+/* The events of the reader (write == 0) or the writer end of a pipe, see Poll() */
+int pipe_poll(pipe_cb *cb, int write, poll_table *pt);
+
+/* Wait until a write of size bytes would not wait. Returns the size that fits (less 
+   only if the buffer is smaller), or 0 if an end is closed. See Splice() */
+int pipe_await_room(pipe_cb *cb, unsigned int size);
+/* Move bytes from one (stream mode) pipe to another, see Splice() */
+int pipe_splice(pipe_cb *src, pipe_cb *dst, unsigned int size);
+
+/* Close an end of a pipe. When both are closed, the pipe is freed */
 int pipe_reader_close(void *_pipecb);
 
 int pipe_writer_close(void *_pipecb);
+
+/* Close an end of a pipe that a socket owns. The pipe is kept, for release_pipe_cb() or pipe_reset() */
+int pipe_shutdown_reader(pipe_cb *cb);
+
+int pipe_shutdown_writer(pipe_cb *cb);
@@ -0,0 +1,199 @@
+#include "tinyos.h"
+#include "kernel_poll.h"
+#include "kernel_cc.h"
+#include "kernel_dev.h"
+#include "kernel_streams.h"
+
+/* An entry of a poll table, in the poll queue of a stream */
+typedef struct poll_entry
+{
+	poll_table *pt;
+	poll_queue *q;
+	rlnode q_node;	// In the waiters of q
+	rlnode pt_node; // In the entries of pt
+} poll_entry;
+
+/* A thread in Poll() */
+typedef struct poller
+{
+	poll_table pt; // Must be first
+	Mutex lock;	   // Protects woken
+	CondVar wakeup;
+	int woken; // Set when one of the queues was notified
+} poller;
+
+void poll_queue_init(poll_queue *q)
+{
+	q->lock = MUTEX_INIT;
+	q->pollers = 0;
+	rlnode_init(&q->waiters, NULL);
+}
+
+void poll_notify(poll_queue *q)
+{
+	if (__atomic_load_n(&q->pollers, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	int pre = preempt_off;
+	Mutex_Lock(&q->lock);
+	for (rlnode *n = q->waiters.next; n != &q->waiters; n = n->next)
+	{
+		poll_table *pt = ((poll_entry *)n->obj)->pt;
+		pt->wake(pt);
+	}
+	Mutex_Unlock(&q->lock);
+	if (pre)
+		preempt_on;
+}
+
+void poll_wait(poll_table *pt, poll_queue *q)
+{
+	if (pt == NULL)
+		return;
+
+	// A stream may be checked many times, we only register once
+	for (rlnode *n = pt->entries.next; n != &pt->entries; n = n->next)
+		if (((poll_entry *)n->obj)->q == q)
+			return;
+
+	poll_entry *e = (poll_entry *)xmalloc(sizeof(poll_entry));
+	e->pt = pt;
+	e->q = q;
+	rlnode_init(&e->q_node, e);
+	rlnode_init(&e->pt_node, e);
+	rlist_push_back(&pt->entries, &e->pt_node);
+
+	int pre = preempt_off;
+	Mutex_Lock(&q->lock);
+	rlist_push_back(&q->waiters, &e->q_node);
+	__atomic_add_fetch(&q->pollers, 1, __ATOMIC_SEQ_CST);
+	Mutex_Unlock(&q->lock);
+	if (pre)
+		preempt_on;
+}
+
+void poll_table_init(poll_table *pt, void (*wake)(poll_table *))
+{
+	pt->wake = wake;
+	rlnode_init(&pt->entries, NULL);
+}
+
+void poll_table_release(poll_table *pt)
+{
+	while (!is_rlist_empty(&pt->entries))
+	{
+		poll_entry *e = rlist_pop_front(&pt->entries)->obj;
+
+		int pre = preempt_off;
+		Mutex_Lock(&e->q->lock);
+		rlist_remove(&e->q_node);
+		__atomic_sub_fetch(&e->q->pollers, 1, __ATOMIC_SEQ_CST);
+		Mutex_Unlock(&e->q->lock);
+		if (pre)
+			preempt_on;
+
+		free(e);
+	}
+}
+
+TimerDuration poll_deadline(timeout_t timeout)
+{
+	return (timeout == NO_POLL_TIMEOUT) ? NO_TIMEOUT : bios_clock() + timeout * 1000ul;
+}
+
+int poll_sleep(Mutex *mx, CondVar *cv, TimerDuration deadline)
+{
+	if (deadline == NO_TIMEOUT)
+		kernel_wait(mx, cv, SCHED_IO);
+	else
+	{
+		TimerDuration now = bios_clock();
+		if (now >= deadline)
+			return 0;
+		kernel_timedwait(mx, cv, SCHED_IO, deadline - now);
+	}
+	return 1;
+}
+
+static void poller_wake(poll_table *pt)
+{
+	poller *p = (poller *)pt;
+	Mutex_Lock(&p->lock);
+	p->woken = 1;
+	kernel_signal(&p->wakeup);
+	Mutex_Unlock(&p->lock);
+}
+
+/* Check the streams, registering pt on them. Returns the number of ready streams */
+static int poll_scan(pollfd_t *fds, FCB **fcb, unsigned int nfds, poll_table *pt)
+{
+	int ready = 0;
+	for (unsigned int i = 0; i < nfds; i++)
+	{
+		int revents;
+		if (fds[i].fd == NOFILE)
+			revents = 0; // Skipped
+		else if (fcb[i] == NULL)
+			revents = POLL_INVALID;
+		else if (fcb[i]->streamfunc->Poll == NULL)
+			revents = POLL_READ | POLL_WRITE; // It never blocks
+		else
+			revents = fcb[i]->streamfunc->Poll(fcb[i]->streamobj, pt);
+
+		// Errors are always reported
+		fds[i].revents = revents & (fds[i].events | POLL_ERROR | POLL_HANGUP | POLL_INVALID);
+		if (fds[i].revents)
+			ready++;
+	}
+	return ready;
+}
+
+int sys_Poll(pollfd_t *fds, unsigned int nfds, timeout_t timeout)
+{
+	if (nfds > MAX_FILEID || (fds == NULL && nfds > 0))
+		return -1;
+
+	// The references keep the streams open while we wait
+	FCB *fcb[MAX_FILEID];
+	for (unsigned int i = 0; i < nfds; i++)
+		fcb[i] = get_fcb_ref(fds[i].fd);
+
+	poller p = {.lock = MUTEX_INIT, .wakeup = COND_INIT, .woken = 0};
+	poll_table_init(&p.pt, poller_wake);
+
+	TimerDuration deadline = poll_deadline(timeout);
+	int ready;
+
+	for (;;)
+	{
+		int pre = preempt_off;
+		Mutex_Lock(&p.lock);
+		p.woken = 0;
+		Mutex_Unlock(&p.lock);
+		if (pre)
+			preempt_on;
+
+		// A change after this point sets woken, so it is not missed
+		ready = poll_scan(fds, fcb, nfds, (timeout == 0) ? NULL : &p.pt);
+		if (ready > 0 || timeout == 0)
+			break;
+
+		int expired = 0;
+		pre = preempt_off;
+		Mutex_Lock(&p.lock);
+		while (!p.woken && !expired)
+			expired = !poll_sleep(&p.lock, &p.wakeup, deadline);
+		Mutex_Unlock(&p.lock);
+		if (pre)
+			preempt_on;
+
+		if (expired)
+			break;
+	}
+
+	poll_table_release(&p.pt);
+	for (unsigned int i = 0; i < nfds; i++)
+		if (fcb[i] != NULL)
+			FCB_decref(fcb[i]);
+	return ready;
+}
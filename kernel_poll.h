@@ -0,0 +1,97 @@
+#ifndef __KERNEL_POLL_H
+#define __KERNEL_POLL_H
+
+#include "tinyos.h"
+#include "util.h"
+#include "bios.h"
+
+/**
+	@file kernel_poll.h
+	@brief Support for waiting on many streams.
+
+	@defgroup poll Polling.
+	@ingroup kernel
+	@brief Support for waiting on many streams.
+
+	A stream object that can be polled keeps a @c poll_queue, and calls
+	@ref poll_notify after every change that may make it readable or
+	writable (or closed). A poll table is put on the poll queue of every 
+	stream it waits for, through the @c Poll operation of the stream, which
+	calls @ref poll_wait. When any of them is notified, the @c wake method
+	of the table is called.
+
+	A thread in @c Poll() has a poll table that wakes it up, so that it
+	checks all the streams again. The watches of an event queue have poll
+	tables that put them on the ready list of the queue.
+
+	The locks of poll queues and poll tables are taken with preemption off,
+	so that interrupt handlers (e.g., of the serial ports) can notify a
+	poll queue.
+
+	@{
+*/
+
+
+/** @brief The pollers of a stream object. */
+typedef struct poll_queue
+{
+	Mutex lock;			/**< @brief Protects @c waiters */
+	uint pollers;		/**< @brief The number of entries, read without the lock (atomic) */
+	rlnode waiters;		/**< @brief The entries of the polling threads */
+} poll_queue;
+
+
+/** @brief A set of poll queues, notified together. */
+typedef struct poll_table
+{
+	/** @brief Called when one of the queues is notified, with the queue 
+		locked and preemption off. It must not sleep. */
+	void (*wake)(struct poll_table* pt);
+	rlnode entries;		/**< @brief The entries of this table in poll queues */
+} poll_table;
+
+
+/** @brief Initialize an empty poll queue. */
+void poll_queue_init(poll_queue* q);
+
+/** @brief Initialize a poll table that is not on any queue. */
+void poll_table_init(poll_table* pt, void (*wake)(poll_table*));
+
+/** @brief Take a poll table off all its queues. 
+
+	Once this returns, @c wake is not called any more.
+ */
+void poll_table_release(poll_table* pt);
+
+/**
+	@brief Wake up the threads polling a stream object.
+
+	This must be called after the change of the stream is visible to
+	the @c Poll operation. It costs an atomic load when nobody polls.
+ */
+void poll_notify(poll_queue* q);
+
+/**
+	@brief Register a poll table on a poll queue.
+
+	Called by the @c Poll operation of a stream. If @c pt is NULL, or it
+	is already on @c q, nothing is done.
+ */
+void poll_wait(poll_table* pt, poll_queue* q);
+
+
+/** @brief The time a wait of @c timeout msec ends, or @c NO_TIMEOUT. */
+TimerDuration poll_deadline(timeout_t timeout);
+
+/**
+	@brief Wait on a condition, until a deadline.
+
+	Like @c kernel_wait, with the lock taken with preemption off. 
+	@returns 0 if the deadline has passed (without waiting), else 1
+ */
+int poll_sleep(Mutex* mx, CondVar* cv, TimerDuration deadline);
+
+
+/** @} */
+
+#endif
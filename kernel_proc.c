@@ -19,6 +19,8 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+Mutex proc_lock = MUTEX_INIT;
+
 PCB* get_pcb(Pid_t pid)
 {
   return PT[pid].pstate==FREE ? NULL : &PT[pid];
@@ -39,6 +41,10 @@ static inline void initialize_PCB(PCB* pcb)
 
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
+  pcb->fidt_lock = MUTEX_INIT;
+  pcb->thread_lock = MUTEX_INIT;
+  pcb->pipe_mem = 0;
+  rlnode_init(& pcb->pipe_list, NULL);
 
   rlnode_init(& pcb->ptcb_list,NULL);
   rlnode_init(& pcb->children_list, NULL);
@@ -76,7 +82,7 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 PCB* acquire_PCB()
 {
@@ -93,7 +99,7 @@ PCB* acquire_PCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_lock held
 */
 void release_PCB(PCB* pcb)
 {
@@ -135,14 +141,31 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   PCB *curproc, *newproc;
   
   /* The new process PCB */
+  Mutex_Lock(&proc_lock);
   newproc = acquire_PCB();
 
-  if(newproc == NULL) goto finish;  /* We have run out of PIDs! */
+  if(newproc == NULL) {
+    Mutex_Unlock(&proc_lock);
+    goto finish;  /* We have run out of PIDs! */
+  }
+
+  /* The main thread is made first, since it is the only step that can fail.
+     It does not run before we wake it up */
+  if(call != NULL) {
+    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    if(newproc->main_thread == NULL) {
+      release_PCB(newproc);
+      newproc = NULL;
+      Mutex_Unlock(&proc_lock);
+      goto finish;  /* We have run out of memory for threads! */
+    }
+  }
 
   if(get_pid(newproc)<=1) {
     /* Processes with pid<=1 (the scheduler and the init process) 
        are parentless and are treated specially. */
     newproc->parent = NULL;
+    curproc = NULL;
   }
   else
   {
@@ -152,13 +175,20 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     /* Add new process to the parent's child list */
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
+  }
+  Mutex_Unlock(&proc_lock);
 
-    /* Inherit file streams from parent */
+  if(curproc != NULL) {
+    /* Inherit file streams from parent (skipping any that are not yet open) */
+    Mutex_Lock(&curproc->fidt_lock);
     for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
+       FCB* fcb = curproc->FIDT[i];
+       if(fcb != NULL && fcb->streamfunc != NULL) {
+          newproc->FIDT[i] = fcb;
+          FCB_incref(fcb);
+       }
     }
+    Mutex_Unlock(&curproc->fidt_lock);
   }
 
 
@@ -180,7 +210,6 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     the initialization of the PCB.
    */
   if(call != NULL) {
-    newproc->main_thread = spawn_thread(newproc, start_main_thread); //We create a new TCB
     PTCB* ptcb = (PTCB*)xmalloc(sizeof(PTCB));                       //Allocating for a new PTCB
     ptcb-> tcb = newproc->main_thread;                               //Initializing the values of our new PTCB
     ptcb->task = newproc -> main_task;
@@ -217,10 +246,15 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  /* The parent only changes when it exits and we are reparented; a
+     single atomic load is enough */
+  return get_pid(__atomic_load_n(&CURPROC->parent, __ATOMIC_ACQUIRE));
 }
 
 
+/*
+  Must be called with proc_lock held
+*/
 static void cleanup_zombie(PCB* pcb, int* status)
 {
   if(status != NULL)
@@ -238,11 +272,11 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Legality checks */
   if((cpid<0) || (cpid>=MAX_PROC)) {
-    cpid = NOPROC;
-    goto finish;
+    return NOPROC;
   }
 
   PCB* parent = CURPROC;
+  Mutex_Lock(&proc_lock);
   PCB* child = get_pcb(cpid);
   if( child == NULL || child->parent != parent)
   {
@@ -252,11 +286,12 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
 finish:
+  Mutex_Unlock(&proc_lock);
   return cpid;
 }
 
@@ -269,6 +304,7 @@ static Pid_t wait_for_any_child(int* status)
 
   /* Make sure I have children! */
   int no_children, has_exited;
+  Mutex_Lock(&proc_lock);
   while(1) {
     no_children = is_rlist_empty(& parent->children_list);
     if( no_children ) break;
@@ -276,16 +312,19 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(&proc_lock, & parent->child_exit, SCHED_USER);    
   }
 
-  if(no_children)
+  if(no_children) {
+    Mutex_Unlock(&proc_lock);
     return NOPROC;
+  }
 
   PCB* child = parent->exited_list.next->pcb;
   assert(child->pstate == ZOMBIE);
   cpid = get_pid(child);
   cleanup_zombie(child, status);
+  Mutex_Unlock(&proc_lock);
 
   return cpid;
 }
@@ -59,13 +59,31 @@ typedef struct process_control_block {
                              @c WaitChild() */
 
   FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
+  Mutex fidt_lock;        /**< @brief Protects @c FIDT */
 
   rlnode ptcb_list;  //adding a list of ptcbs
   int thread_count;
+  Mutex thread_lock;      /**< @brief Protects @c ptcb_list, @c thread_count and the PTCBs */
+
+  size_t pipe_mem;        /**< @brief Bytes of pipe buffers charged to this process */
+  rlnode pipe_list;       /**< @brief The pipes charged to this process (see kernel_pipe.c) */
   
 } PCB;
 
 
+/**
+  @brief The process table lock.
+
+  This mutex protects the process table and the process tree, i.e.,
+  the @c pstate, @c parent, @c children_list and @c exited_list fields 
+  of every PCB. The @c child_exit condition is waited on with this lock.
+
+  The @c parent field is written atomically, so that a process can read
+  its own parent without the lock (see @c GetPPid).
+*/
+extern Mutex proc_lock;
+
+
 /**
   @brief Initialize the process table.
 
@@ -11,7 +11,6 @@
 #include <valgrind/valgrind.h>
 #endif
 
-#define N 5
 #define MaxIncrease 420
 
 
@@ -58,24 +57,29 @@ TCB* cur_thread()
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  Each thread is allocated a single memory block, holding the TCB at the 
+  lowest addresses and the stack above it. On x86 the stack grows towards
+  lower addresses, i.e., towards the TCB. A guard page (without any access
+  permissions) separates the two, so that a stack overrun causes a 
+  segmentation fault instead of silently corrupting the TCB.
 
+  +-------------+  <- block + THREAD_BLOCK_SIZE(stack_size)
+  | first frame |
   +-------------+
-  |   TCB       |
-  +-------------+
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
-  | first frame |
+  | guard page  |
   +-------------+
+  |   TCB       |
+  +-------------+  <- block
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  The block is mapped with MAP_NORESERVE, so that only the stack pages
+  actually touched by the thread are ever committed. Thus, threads with 
+  large stacks that are not used cost little.
 
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
   we do not support stack growth anyway!
@@ -91,47 +95,89 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
 
+/* Round up to a multiple of SYSTEM_PAGE_SIZE */
+#define PAGE_ROUNDUP(size) \
+	((((size) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
+
 /* The memory allocated for the TCB must be a multiple of SYSTEM_PAGE_SIZE */
-#define THREAD_TCB_SIZE \
-	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
+#define THREAD_TCB_SIZE PAGE_ROUNDUP(sizeof(TCB))
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/* The size of a thread block, for a given stack size */
+#define THREAD_BLOCK_SIZE(stack_size) (THREAD_TCB_SIZE + SYSTEM_PAGE_SIZE + (stack_size))
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+/* The stack of a thread */
+#define THREAD_STACK(tcb) (((void*)(tcb)) + THREAD_TCB_SIZE + SYSTEM_PAGE_SIZE)
 
-/*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
- */
 void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
 
+/* Returns NULL when the block cannot be mapped (e.g., at vm.max_map_count) */
 void* allocate_thread(size_t size)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+
+	if (ptr == MAP_FAILED)
+		return NULL;
 
-	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	/* Set up the guard page */
+	if (mprotect(ptr + THREAD_TCB_SIZE, SYSTEM_PAGE_SIZE, PROT_NONE) != 0) {
+		free_thread(ptr, size);
+		return NULL;
+	}
 
 	return ptr;
 }
-#else
+
+
 /*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
+  Each core keeps a cache of free thread blocks (TCB + stack), so that
+  creating a thread does not normally go to the allocator. Only blocks
+  with the default stack size are cached.
+
+  The cache is only accessed by its own core, with preemption off, 
+  so it needs no locking. When it grows to THREAD_CACHE_HIGH blocks, 
+  it is trimmed down to THREAD_CACHE_LOW blocks.
  */
-void free_thread(void* ptr, size_t size) { free(ptr); }
+_Static_assert(THREAD_CACHE_LOW <= THREAD_CACHE_HIGH, "Bad thread cache watermarks");
 
-void* allocate_thread(size_t size)
+static TCB* thread_cache_get(CCB* core)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	if (core->thread_cache_size == 0) {
+		core->thread_cache_misses++;
+		return NULL;
+	}
+	core->thread_cache_size--;
+	core->thread_cache_hits++;
+	return rlist_pop_front(&core->thread_cache)->tcb;
+}
+
+static void thread_cache_put(CCB* core, TCB* tcb)
+{
+	rlist_push_front(&core->thread_cache, rlnode_init(&tcb->sched_node, tcb));
+	core->thread_cache_size++;
+
+	if (core->thread_cache_size >= THREAD_CACHE_HIGH)
+		while (core->thread_cache_size > THREAD_CACHE_LOW) {
+			free_thread(rlist_pop_back(&core->thread_cache)->tcb, THREAD_BLOCK_SIZE(THREAD_STACK_SIZE));
+			core->thread_cache_size--;
+		}
 }
-#endif
 
+static void thread_cache_drain(CCB* core)
+{
+	while (core->thread_cache_size > 0) {
+		free_thread(rlist_pop_front(&core->thread_cache)->tcb, THREAD_BLOCK_SIZE(THREAD_STACK_SIZE));
+		core->thread_cache_size--;
+	}
+}
 
+void get_thread_cache_stats(uint core, thread_cache_stats* stats)
+{
+	CCB* ccb = &cctx[core];
+	stats->size = ccb->thread_cache_size;
+	stats->hits = ccb->thread_cache_hits;
+	stats->misses = ccb->thread_cache_misses;
+}
 
 
 /*
@@ -155,8 +201,33 @@ static void thread_start()
 
 TCB* spawn_thread(PCB* pcb, void (*func)())
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	return spawn_thread_stack(pcb, func, THREAD_STACK_SIZE);
+}
+
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size)
+{
+	/* The stack size must be a multiple of page size, within limits */
+	if (stack_size == 0)
+		stack_size = THREAD_STACK_SIZE;
+	else if (stack_size < THREAD_STACK_MIN)
+		stack_size = THREAD_STACK_MIN;
+	else if (stack_size > THREAD_STACK_MAX)
+		stack_size = THREAD_STACK_MAX;
+	stack_size = PAGE_ROUNDUP(stack_size);
+
+	/* Try the cache of this core first */
+	TCB* tcb = NULL;
+	if (stack_size == THREAD_STACK_SIZE) {
+		int preempt = preempt_off;
+		tcb = thread_cache_get(&CURCORE);
+		if (preempt)
+			preempt_on;
+	}
+
+	if (tcb == NULL)
+		tcb = (TCB*)allocate_thread(THREAD_BLOCK_SIZE(stack_size));
+	if (tcb == NULL)
+		return NULL;
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -167,6 +238,8 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->phase = CTX_CLEAN;
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
+	tcb->priority = PRIORITY_LEVELS - 1;
+	tcb->core = &CURCORE; /* Any core will do, the new thread can be stolen */
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
 
 	tcb->its = QUANTUM;
@@ -175,13 +248,14 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->curr_cause = SCHED_IDLE;
 
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	tcb->stack_size = stack_size;
+	void* sp = THREAD_STACK(tcb);
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
 #endif
 
 	/* increase the count of active threads */
@@ -193,7 +267,8 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called with preemption off, but not with the core's sched_spinlock
+  locked, since it may unmap the block.
  */
 void release_TCB(TCB* tcb)
 {
@@ -201,7 +276,10 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	if (tcb->stack_size == THREAD_STACK_SIZE)
+		thread_cache_put(&CURCORE, tcb);
+	else
+		free_thread(tcb, THREAD_BLOCK_SIZE(tcb->stack_size));
 
 	Mutex_Lock(&active_threads_spinlock);
 	active_threads--;
@@ -219,19 +297,21 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
-
-  Both of these structures are protected by @c sched_spinlock.
+  Every core owns a set of scheduler queues (one doubly linked list per
+  priority level) and a timer wheel of its sleeping threads with a timeout.
+  These are stored in the CCB and are protected by the core's 
+  @c sched_spinlock.
+
+  Each TCB is owned by one core, designated by @c tcb->core. The state of 
+  a thread is only changed while holding the spinlock of its owning core.
+  A running thread is always owned by the core it runs on. The owner of a 
+  thread changes only when a ready thread is stolen from the queues of
+  another core; this is done while holding the spinlocks of both cores.
+
+  To avoid deadlocks, a core never waits for the spinlock of another core
+  while holding its own; it uses @c Mutex_TryLock instead.
 */
 
-rlnode SCHED[N]; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
-
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
 
@@ -241,56 +321,122 @@ void ici_handler()
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Lock the core that owns a thread and return it.
+
+  Since the owner of a thread may change while we are waiting for
+  the lock, we must check again after locking.
+ */
+static CCB* sched_lock_owner(TCB* tcb)
+{
+	while (1) {
+		CCB* core = __atomic_load_n(&tcb->core, __ATOMIC_ACQUIRE);
+		Mutex_Lock(&core->sched_spinlock);
+		if (core == tcb->core)
+			return core;
+		Mutex_Unlock(&core->sched_spinlock);
+	}
+}
+
+/*
+  The timeouts of each core are kept in a hashed timer wheel. A sleeping 
+  thread is placed in the slot of its wakeup tick (modulo the wheel size),
+  so that insertion and removal take O(1) time. Threads sleeping for more
+  than a full turn of the wheel simply stay in their slot until their 
+  wakeup time is reached.
+ */
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_TICK_OF(t) ((t) / TIMER_WHEEL_TICK)
+
+_Static_assert((TIMER_WHEEL_SLOTS & TIMER_WHEEL_MASK) == 0, 
+	"TIMER_WHEEL_SLOTS must be a power of 2");
+
+/*
+  Possibly add TCB to the timer wheel of its core.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->core->sched_spinlock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
 	if (timeout != NO_TIMEOUT) {
+		CCB* core = tcb->core;
+
 		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
-
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		tcb->wakeup_time = bios_clock() + timeout;
+
+		/* add to the slot of the wakeup tick */
+		rlnode* slot = &core->timer_wheel[TIMER_TICK_OF(tcb->wakeup_time) & TIMER_WHEEL_MASK];
+		rlist_push_back(slot, &tcb->sched_node);
+		core->timer_count++;
 	}
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Add TCB to the end of the scheduler list of its core.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->core->sched_spinlock HELD ***
 */
 static void sched_queue_add(TCB* tcb)
 {
+	CCB* core = tcb->core;
+
 	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+	rlist_push_back(&core->ready_queue[tcb->priority], &tcb->sched_node);
+	core->ready_mask |= 1u << tcb->priority;
+	core->ready_count++;
+
+	/* 
+		Restart possibly halted cores. If the owner is idle, it will take
+		the thread itself, else some other core may steal it.
+	 */
+	if (core->current_thread == &core->idle_thread)
+		cpu_core_restart(core->id);
+	else
+		cpu_core_restart_one();
+}
+
+/*
+  Remove the head of the highest-priority non-empty list of a core,
+  and return it. Return NULL if all lists are empty.
+
+  The highest non-empty level is found from @c ready_mask in O(1).
+  The thread is given the priority of the level it was taken from, since
+  aging may have moved it up since it was queued.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_pop(CCB* core)
+{
+	unsigned int mask = core->ready_mask;
+	if (mask == 0)
+		return NULL;
+
+	int level = (int)(sizeof(mask) * 8 - 1) - __builtin_clz(mask);
+	rlnode* queue = &core->ready_queue[level];
+
+	TCB* tcb = rlist_pop_front(queue)->tcb;
+	if (is_rlist_empty(queue))
+		core->ready_mask &= ~(1u << level);
+	core->ready_count--;
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	tcb->priority = level;
+	return tcb;
 }
 
 /*
 	Adjust the state of a thread to make it READY.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+	*** MUST BE CALLED WITH tcb->core->sched_spinlock HELD ***
  */
 static void sched_make_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from the timer wheel */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
+		/* tcb is in the timer wheel, fix it */
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
 		rlist_remove(&tcb->sched_node);
+		tcb->core->timer_count--;
 		tcb->wakeup_time = NO_TIMEOUT;
 	}
 
@@ -303,50 +449,89 @@ static void sched_make_ready(TCB* tcb)
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Visit the slots of the timer wheel of a core, from the last drained tick
+  up to the current tick, and wake up the threads whose timeout has expired.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
 */
-static void sched_wakeup_expired_timeouts()
+static void sched_wakeup_expired_timeouts(CCB* core)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
 	TimerDuration curtime = bios_clock();
+	TimerDuration curtick = TIMER_TICK_OF(curtime);
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
+	if (core->timer_count == 0) {
+		core->timer_tick = curtick;
+		return;
+	}
+
+	/* The current tick is only partly expired, so it is visited again next time */
+	TimerDuration ticks = curtick - core->timer_tick + 1;
+	if (ticks > TIMER_WHEEL_SLOTS)
+		ticks = TIMER_WHEEL_SLOTS;
+
+	for (TimerDuration t = curtick - ticks + 1; t <= curtick && core->timer_count > 0; t++) {
+		rlnode* slot = &core->timer_wheel[t & TIMER_WHEEL_MASK];
+		rlnode* n = slot->next;
+		while (n != slot) {
+			TCB* tcb = n->tcb;
+			n = n->next;
+			if (tcb->wakeup_time <= curtime)
+				sched_make_ready(tcb);
+		}
 	}
+
+	core->timer_tick = curtick;
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Try to steal a ready thread from the queues of some other core.
+  The stolen thread becomes owned by @c core. Busy victims are skipped.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
 */
-static TCB* sched_queue_select(TCB* current)
+static TCB* sched_steal(CCB* core)
 {
-	int curr_priority = N - 1;
-	for (int i = N - 1; i >= 0; i--) //We start a loop from the second highest level of priority, to the lowest
-	{ 
-		if (!is_rlist_empty(&SCHED[i])) //On every loop, if the queue of the level isn't empty,
-										//we break the loop and curr_priority changes to the one of the loop
-		{ 
-			curr_priority = i;
-			break;
-		}
+	uint ncores = cpu_cores();
+
+	for (uint i = 1; i < ncores; i++) {
+		CCB* victim = &cctx[(core->id + i) % ncores];
+
+		/* Check without locking first */
+		if (victim->ready_count == 0)
+			continue;
+		if (!Mutex_TryLock(&victim->sched_spinlock))
+			continue;
+
+		TCB* tcb = sched_queue_pop(victim);
+		if (tcb != NULL)
+			__atomic_store_n(&tcb->core, core, __ATOMIC_RELEASE);
+
+		Mutex_Unlock(&victim->sched_spinlock);
+
+		if (tcb != NULL)
+			return tcb;
 	}
+	return NULL;
+}
+
+/*
+  Select the next thread to run on a core. First look at the core's own 
+  queues, then try to steal from other cores, unless the current thread can
+  keep running.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_select(CCB* core, TCB* current)
+{
+	TCB* next_thread = sched_queue_pop(core);
 
-	/* Get the head of the SCHED list */
-	rlnode* sel = rlist_pop_front(&SCHED[curr_priority]);
+	int current_ready = (current->state == READY && current->type != IDLE_THREAD);
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	if (next_thread == NULL && !current_ready)
+		next_thread = sched_steal(core);
 
 	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		next_thread = (current->state == READY) ? current : &core->idle_thread;
 
 	next_thread->its = QUANTUM;
 
@@ -363,15 +548,15 @@ int wakeup(TCB* tcb)
 	/* Preemption off */
 	int oldpre = preempt_off;
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	/* To touch tcb->state, we must get the spinlock of its core. */
+	CCB* core = sched_lock_owner(tcb);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
 		sched_make_ready(tcb);
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&core->sched_spinlock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -390,8 +575,9 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 
 	int preempt = preempt_off;
-	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	CCB* core = &CURCORE;
+	TCB* tcb = core->current_thread;
+	Mutex_Lock(&core->sched_spinlock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -405,7 +591,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 		Mutex_Unlock(mx);
 
 	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&core->sched_spinlock);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -415,44 +601,49 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 		preempt_on;
 }
 
-void increase_priorities()
+/*
+  Move every thread of the core queues one priority level up,
+  to prevent starvation.
+
+  Whole levels are appended to the level above, so this takes time
+  proportional to the number of levels, not of threads. The priority 
+  of each moved thread is fixed when it is popped (see sched_queue_pop).
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void increase_priorities(CCB* core)
 {
-	for (int i = 0; i < N - 1; i++)
-	{ //Running a loop for every priority except the highest possible
-		if (!is_rlist_empty(&SCHED[i])) //Checking if the queue is empty
-		{ 
-			for (int j = 0; j < rlist_len(&SCHED[i]); j++)	//For every thread in our queue
-			{													  
-				TCB *tcb = rlist_pop_front(&SCHED[i])->tcb;		  //We "pop" the first thread of the queue
-				tcb->priority++;								  //Then we increase its priority
-				rlist_push_back(&SCHED[i + 1], &tcb->sched_node); //Finally, push it back to the end of the higher priority queue
-			}
-		}
-	}
+	const unsigned int top = 1u << (PRIORITY_LEVELS - 1);
+	const unsigned int all = (top << 1) - 1;
+
+	for (int i = PRIORITY_LEVELS - 2; i >= 0; i--) //Every priority except the highest possible
+		rlist_append(&core->ready_queue[i + 1], &core->ready_queue[i]);
+
+	/* Every level shifts up, and the top level absorbs the one below it */
+	core->ready_mask = ((core->ready_mask << 1) | (core->ready_mask & top)) & all;
 }
 
 /* This function is the entry point to the scheduler's context switching */
 
 void yield(enum SCHED_CAUSE cause)
 {
-	int static increment = 0;			//Once we reach the limit of MaxIncrease, we increase this counter,
-										//which represents the priorities of all threads, to prevent starvation
-    increment++;									
-    if(increment == MaxIncrease){
-        increase_priorities();	
-        increment = 0;						//Resetting the counter
-    }
-	
-	
 	/* Reset the timer, so that we are not interrupted by ALARM */
 	TimerDuration remaining = bios_cancel_timer();
 
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+	CCB* core = &CURCORE;
+	TCB* current = core->current_thread; /* Make a local copy of current process, for speed */
+
+	Mutex_Lock(&core->sched_spinlock);
 
-	Mutex_Lock(&sched_spinlock);
+	/* Once we reach the limit of MaxIncrease, we increase the priorities 
+	   of all ready threads of this core, to prevent starvation */
+	if (++core->yield_count == MaxIncrease) {
+		increase_priorities(core);
+		core->yield_count = 0;
+	}
 
 	/* Update CURTHREAD state */
 	if (current->state == RUNNING)
@@ -464,20 +655,20 @@ void yield(enum SCHED_CAUSE cause)
 	current->curr_cause = cause;
 
 	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
+	sched_wakeup_expired_timeouts(core);
 
 	/* Get next */
-	TCB* next = sched_queue_select(current);
+	TCB* next = sched_queue_select(core, current);
 	assert(next != NULL);
 
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
+	core->previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&core->sched_spinlock);
 
 	/* Switch contexts */
 	if (current != next) {
-		CURTHREAD = next;
+		core->current_thread = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
 
@@ -490,7 +681,7 @@ void yield(enum SCHED_CAUSE cause)
       }
       break;
      case SCHED_IO:						//The thread leaves before the quantum
-      if(current->priority!=N-1){ 		//Checking if the priority isn't the highest
+      if(current->priority!=PRIORITY_LEVELS-1){ 		//Checking if the priority isn't the highest
       	current->priority++;			//Increasing it
       } 
       break;	
@@ -527,9 +718,11 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
+	CCB* core = &CURCORE;
 
-	TCB* current = CURTHREAD;
+	Mutex_Lock(&core->sched_spinlock);
+
+	TCB* current = core->current_thread;
 
 	/* Mark current state */
 	current->state = RUNNING;
@@ -537,8 +730,10 @@ void gain(int preempt)
 	current->rts = current->its;
 
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = core->previous_thread;
+	TCB* exited = NULL;
 	if (current != prev) {
+		assert(prev->core == core || prev->type == IDLE_THREAD);
 		prev->phase = CTX_CLEAN;
 		switch (prev->state) {
 		case READY:
@@ -546,7 +741,7 @@ void gain(int preempt)
 				sched_queue_add(prev);
 			break;
 		case EXITED:
-			release_TCB(prev);
+			exited = prev;
 			break;
 		case STOPPED:
 			break;
@@ -555,7 +750,11 @@ void gain(int preempt)
 		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&core->sched_spinlock);
+
+	/* Nobody else uses the exited thread, and preemption is still off */
+	if (exited != NULL)
+		release_TCB(exited);
 
 	/* Reset preemption as needed */
 	if (preempt)
@@ -582,15 +781,35 @@ static void idle_thread()
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues of all cores.
+
+  This is called by one core only, before any core enters the scheduler.
  */
 void initialize_scheduler()
 {
-	//Here we initialize the queues for every level of priority
-	for(int i=0;i<N; i++) {
-		rlnode_init(&SCHED[i], NULL);
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* core = &cctx[c];
+		core->id = c;
+		core->sched_spinlock = MUTEX_INIT;
+		//Here we initialize the queues for every level of priority
+		for (int i = 0; i < PRIORITY_LEVELS; i++)
+			rlnode_init(&core->ready_queue[i], NULL);
+		core->ready_mask = 0;
+		core->ready_count = 0;
+		for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+			rlnode_init(&core->timer_wheel[i], NULL);
+		core->timer_tick = TIMER_TICK_OF(bios_clock());
+		core->timer_count = 0;
+		core->yield_count = 0;
+
+		rlnode_init(&core->thread_cache, NULL);
+		core->thread_cache_size = 0;
+		core->thread_cache_hits = 0;
+		core->thread_cache_misses = 0;
+
+		/* Until the core enters the scheduler, it is considered idle */
+		core->current_thread = &core->idle_thread;
 	}
-	rlnode_init(&TIMEOUT_LIST, NULL);
 }
 
 void run_scheduler()
@@ -607,6 +826,7 @@ void run_scheduler()
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.core = curcore;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
@@ -625,6 +845,7 @@ void run_scheduler()
 
 	/* Finished scheduling */
 	assert(CURTHREAD == &CURCORE.idle_thread);
+	thread_cache_drain(curcore);
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
 }
@@ -128,9 +128,11 @@ PTCB* ptcb; //adding a ptcb to know to which ptcb this tcb is linked with
 	Thread_phase phase; /**< @brief The phase of the thread */
 
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
+	size_t stack_size; /**< @brief The size of the thread stack */
 
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
 
+	CCB* core; /**< @brief The core whose scheduler queues own this thread */
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
 	TimerDuration rts; /**< @brief Remaining time-slice for this thread */
@@ -161,15 +163,45 @@ int priority;
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief The minimum thread stack size (16 kbytes). */
+#define THREAD_STACK_MIN (16 * 1024)
+
+/** @brief The maximum thread stack size (8 Mbytes). */
+#define THREAD_STACK_MAX (8 * 1024 * 1024)
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief The number of priority levels of the scheduler queues (at most 32). */
+#define PRIORITY_LEVELS 5
+
+/** @brief The number of slots of the per-core timer wheel (a power of 2). */
+#define TIMER_WHEEL_SLOTS 256
+
+/** @brief The time span (in usec) covered by each slot of the timer wheel. */
+#define TIMER_WHEEL_TICK 1000
+
+/** @brief When a core caches this many free thread blocks, it trims its cache... */
+#ifndef THREAD_CACHE_HIGH
+#define THREAD_CACHE_HIGH 64
+#endif
+
+/** @brief ...down to this many blocks. */
+#ifndef THREAD_CACHE_LOW
+#define THREAD_CACHE_LOW 16
+#endif
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns its own multilevel run queues and timer wheel, protected
+  by the core's @c sched_spinlock. A thread is owned by exactly one core 
+  at a time (see @c TCB::core); idle cores steal ready threads from the
+  queues of busy cores.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
@@ -178,6 +210,20 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	Mutex sched_spinlock; /**< @brief Spinlock for the queues of this core */
+	rlnode ready_queue[PRIORITY_LEVELS]; /**< @brief The run queues, one per priority level */
+	unsigned int ready_mask; /**< @brief Bit i is set iff @c ready_queue[i] is not empty */
+	volatile unsigned int ready_count; /**< @brief The number of threads in the run queues */
+	rlnode timer_wheel[TIMER_WHEEL_SLOTS]; /**< @brief The sleeping threads of this core with a timeout, hashed by wakeup tick */
+	TimerDuration timer_tick; /**< @brief The last wheel tick that was drained */
+	unsigned int timer_count; /**< @brief The number of threads in the timer wheel */
+	unsigned int yield_count; /**< @brief Yields since the last priority boost */
+
+	rlnode thread_cache; /**< @brief Free TCB+stack blocks, recycled by @c spawn_thread */
+	unsigned int thread_cache_size; /**< @brief The number of blocks in @c thread_cache */
+	unsigned long thread_cache_hits; /**< @brief Thread allocations served by the cache */
+	unsigned long thread_cache_misses; /**< @brief Thread allocations served by the allocator */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -225,10 +271,35 @@ TCB* cur_thread();
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
-    @returns  A pointer to the TCB of the new thread, in the @c INIT state.
+    @returns  A pointer to the TCB of the new thread, in the @c INIT state,
+              or NULL if its memory cannot be mapped.
 */
 TCB* spawn_thread(PCB* pcb, void (*func)());
 
+/**
+	@brief Create a new thread with a given stack size.
+
+	This is the same as @c spawn_thread(), except that the new thread
+	has a stack of (about) @c stack_size bytes. The size is rounded up to
+	a multiple of the page size and clamped between @c THREAD_STACK_MIN 
+	and @c THREAD_STACK_MAX. A size of 0 selects @c THREAD_STACK_SIZE.
+
+	The stack memory is committed lazily, as it is touched by the thread.
+	However, every thread block that does not come from the thread cache
+	is a separate mapping, split in up to 3 areas by its guard page, and
+	Linux limits the areas of a process to @c vm.max_map_count (65530 by
+	default). Thus, at most about 20000 such threads can exist at once;
+	beyond that, this call fails.
+
+	@param pcb  The process control block of the owning process.
+	@param func The function to execute in the new thread.
+	@param stack_size The requested stack size in bytes.
+	@returns  A pointer to the TCB of the new thread, in the @c INIT state,
+	          or NULL if its memory cannot be mapped.
+	@see spawn_thread
+*/
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size);
+
 /**
   @brief Wakeup a blocked thread.
 
@@ -298,6 +369,21 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void);
 
+/** @brief Statistics of the thread cache of a core. */
+typedef struct thread_cache_stats {
+	unsigned int size; /**< @brief The number of cached blocks */
+	unsigned long hits; /**< @brief Thread allocations served by the cache */
+	unsigned long misses; /**< @brief Thread allocations served by the allocator */
+} thread_cache_stats;
+
+/**
+  @brief Get the statistics of the thread cache of a core.
+
+  This is meant for debugging and testing. The cache of another core
+  may change while it is read, so its statistics are approximate.
+ */
+void get_thread_cache_stats(uint core, thread_cache_stats* stats);
+
 /**
   @brief Quantum (in microseconds) 
 
@@ -4,6 +4,7 @@
 #include "kernel_streams.h"
 #include "kernel_sched.h"
 #include "kernel_cc.h"
+#include "kernel_sys.h"
 
 /*
 The listener calls the socket and the socket calls
@@ -16,17 +17,108 @@ When the procedure is over, the requester calls close() and it sends EOF to our
 so it can call close() too once it serves all requests.
 */
 
+/*
+The port table, the type of every socket, the request queues of the listeners
+and the admission of requests are protected by port_lock. Once connected, the
+peers only touch their pipes, which have their own locks.
+*/
+static Mutex port_lock = MUTEX_INIT;
+
+// The pipes of a connected socket
+static void *socket_get_pipe(void *this, int write)
+{
+	socketCB *cb = (socketCB *)this;
+	if (cb->type != PEER)
+		return NULL;
+	return write ? cb->peer.writePipe : cb->peer.readPipe;
+}
+
+// The events of a socket, see Poll(). The state is read without the port table lock
+static int socket_poll(void *this, poll_table *pt)
+{
+	socketCB *cb = (socketCB *)this;
+	poll_wait(pt, &cb->pollq);
+
+	switch (__atomic_load_n(&cb->type, __ATOMIC_SEQ_CST))
+	{
+	case PEER:
+		return pipe_poll(cb->peer.readPipe, 0, pt) | pipe_poll(cb->peer.writePipe, 1, pt);
+	case LISTENER:
+		// Accept does not wait when a request is queued
+		return (__atomic_load_n(&cb->listener.queued, __ATOMIC_SEQ_CST) > 0) ? POLL_READ : 0;
+	case DGRAM:
+		// SendTo never waits
+		return (__atomic_load_n(&cb->dgram.bytes, __ATOMIC_SEQ_CST) > 0) ? POLL_READ | POLL_WRITE : POLL_WRITE;
+	default:
+		return 0;
+	}
+}
+
 file_ops socket_file_ops = {
 	.Open = NULL,
 	.Read = socket_read,
 	.Write = socket_write,
-	.Close = socket_close};
+	.Close = socket_close,
+	.GetPipe = socket_get_pipe,
+	.ReadV = socket_readv,
+	.WriteV = socket_writev,
+	.Poll = socket_poll};
+
+// Take the oldest datagram from the queue of a datagram socket, waiting for one
+// (unless nonblock is set), and spread it over the buffers of iov
+static int dgram_recv(socketCB *cb, const iovec_t *iov, unsigned int iovcnt, port_t *port, int nonblock)
+{
+	sockDgram *d = &cb->dgram;
+
+	if (cb->port == NOPORT) // Nobody can send to it
+		return -1;
+
+	Mutex_Lock(&d->lock);
+	while (is_rlist_empty(&d->queue) && !d->closed)
+	{
+		if (nonblock)
+		{
+			Mutex_Unlock(&d->lock);
+			return WOULD_BLOCK;
+		}
+		kernel_wait(&d->lock, &d->has_data, SCHED_PIPE);
+	}
+
+	if (d->closed)
+	{
+		Mutex_Unlock(&d->lock);
+		return -1;
+	}
+
+	datagram *msg = rlist_pop_front(&d->queue)->obj;
+	d->bytes -= sizeof(datagram) + msg->size;
+	Mutex_Unlock(&d->lock);
+
+	// The rest of a datagram larger than the buffers is lost
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < iovcnt && n < msg->size; i++)
+	{
+		unsigned int len = (iov[i].len < msg->size - n) ? iov[i].len : msg->size - n;
+		memcpy(iov[i].buf, msg->data + n, len);
+		n += len;
+	}
+	if (port != NULL)
+		*port = msg->from;
+	free(msg);
+	return n;
+}
 
 int socket_read(void *this, char *buf, unsigned int size)
 {
 	// Grab the SCB
 	socketCB *cb = (socketCB *)this;
 
+	if (cb->type == DGRAM)
+	{
+		iovec_t iov = {buf, size};
+		return dgram_recv(cb, &iov, 1, NULL, 0);
+	}
+
 	// If it's connected and the reader is open read
 	if (cb->type == PEER && cb->peer.readPipe != NULL)
 	{
@@ -54,6 +146,131 @@ int socket_write(void *this, const char *buf, unsigned int size)
 		return NOFILE;
 }
 
+int socket_readv(void *this, const iovec_t *iov, unsigned int iovcnt, int nonblock)
+{
+	socketCB *cb = (socketCB *)this;
+
+	if (cb->type == DGRAM)
+		return dgram_recv(cb, iov, iovcnt, NULL, nonblock);
+
+	// One read from the pipe for all the buffers
+	if (cb->type == PEER && cb->peer.readPipe != NULL)
+		return pipe_readv(cb->peer.readPipe, iov, iovcnt, nonblock);
+	else
+		return NOFILE;
+}
+
+int socket_writev(void *this, const iovec_t *iov, unsigned int iovcnt, int nonblock)
+{
+	socketCB *cb = (socketCB *)this;
+
+	// One write to the pipe for all the buffers (a single message on a packet socket)
+	if (cb->type == PEER && cb->peer.writePipe != NULL)
+		return pipe_writev(cb->peer.writePipe, iov, iovcnt, nonblock);
+	else
+		return NOFILE;
+}
+
+// Allocate a pipe pair, with all the ends of its pipes closed and not charged
+static pipePair *alloc_pipe_pair(int packet)
+{
+	pipePair *pair = (pipePair *)xmalloc(sizeof(pipePair));
+	pipe_t closed = {.read = NOFILE, .write = NOFILE};
+	pair->pipe[0] = acquire_pipe_cb(closed, packet);
+	pair->pipe[1] = acquire_pipe_cb(closed, packet);
+	pipe_set_owner(pair->pipe[0], NULL);
+	pipe_set_owner(pair->pipe[1], NULL);
+	pair->users = 0;
+	pair->listener = NULL;
+	pair->sock = NULL;
+	rlnode_init(&pair->node, pair);
+	return pair;
+}
+
+// Allocate a pipe pair for a listener, with the socket of the accepting end
+static pipePair *alloc_accept_pair(int packet)
+{
+	pipePair *pair = alloc_pipe_pair(packet);
+	pair->sock = (socketCB *)xmalloc(sizeof(socketCB));
+	return pair;
+}
+
+static void free_pipe_pair(pipePair *pair)
+{
+	release_pipe_cb(pair->pipe[0]);
+	release_pipe_cb(pair->pipe[1]);
+	free(pair->sock);
+	free(pair);
+}
+
+// Connect two unbound sockets over a pipe pair, charged to the current process.
+// The pipes are wired before the type changes, since socket_read/socket_write
+// do not lock the port table
+static void connect_peers(socketCB *a, Fid_t afid, socketCB *b, Fid_t bfid, pipePair *pair)
+{
+	pipe_reset(pair->pipe[0], (pipe_t){.read = bfid, .write = afid});
+	pipe_reset(pair->pipe[1], (pipe_t){.read = afid, .write = bfid});
+	pipe_set_owner(pair->pipe[0], CURPROC);
+	pipe_set_owner(pair->pipe[1], CURPROC);
+	pair->users = 2;
+
+	a->peer.readPipe = pair->pipe[1];
+	a->peer.writePipe = pair->pipe[0];
+	a->peer.pair = pair;
+	a->type = PEER;
+
+	b->peer.readPipe = pair->pipe[0];
+	b->peer.writePipe = pair->pipe[1];
+	b->peer.pair = pair;
+	b->type = PEER;
+
+	poll_notify(&a->pollq);
+	poll_notify(&b->pollq);
+}
+
+// A peer was closed. After the last one, nobody can reach the pipes any more,
+// so they go back to the pool of their listener, or they are freed
+static void release_pipe_pair(pipePair *pair)
+{
+	Mutex_Lock(&port_lock);
+	if (--pair->users > 0)
+	{
+		Mutex_Unlock(&port_lock);
+		return;
+	}
+
+	socketCB *l = pair->listener;
+	if (l != NULL)
+		rlist_remove(&pair->node);
+
+	if (l != NULL && l->listener.pooled < l->listener.backlog)
+	{
+		pipe_t closed = {.read = NOFILE, .write = NOFILE};
+		pipe_reset(pair->pipe[0], closed);
+		pipe_reset(pair->pipe[1], closed);
+		pipe_set_owner(pair->pipe[0], NULL);
+		pipe_set_owner(pair->pipe[1], NULL);
+		pair->listener = NULL;
+		rlist_push_back(&l->listener.pool, &pair->node);
+		l->listener.pooled++;
+		Mutex_Unlock(&port_lock);
+		return;
+	}
+
+	Mutex_Unlock(&port_lock);
+	free_pipe_pair(pair);
+}
+
+// Free the backlog slots, once no Connect uses them. Called with the port table locked
+static void release_slots(sockLis *l)
+{
+	if (l->pending == 0)
+	{
+		free(l->slots);
+		l->slots = NULL;
+	}
+}
+
 int socket_close(void *this)
 {
 	// If the object is valid
@@ -66,17 +283,64 @@ int socket_close(void *this)
 		if (cb->type == PEER)
 		{
 			int r, w;
-			r = pipe_reader_close(cb->peer.readPipe);
-			w = pipe_writer_close(cb->peer.writePipe);
-			if (r + w != 0) // 0 means they are closed, anything else means something is open or both
-				return -1;
+			r = pipe_shutdown_reader(cb->peer.readPipe);
+			w = pipe_shutdown_writer(cb->peer.writePipe);
+			// From here on, an accepted socket may be reused or freed with its pipes
+			release_pipe_pair(cb->peer.pair);
+			// 0 means they are closed, anything else means something is open or both
+			return (r + w != 0) ? -1 : 0;
+		}
+
+		// If it's a datagram socket, it stops receiving
+		if (cb->type == DGRAM)
+		{
+			sockDgram *d = &cb->dgram;
+
+			Mutex_Lock(&port_lock);
+			if (cb->port != NOPORT && DGRAM_MAP[cb->port] == cb)
+				__atomic_store_n(&DGRAM_MAP[cb->port], NULL, __ATOMIC_RELEASE);
+			Mutex_Unlock(&port_lock);
+
+			Mutex_Lock(&d->lock);
+			d->closed = 1;
+			while (!is_rlist_empty(&d->queue))
+				free(rlist_pop_front(&d->queue)->obj);
+			d->bytes = 0;
+			kernel_broadcast(&d->has_data);
+			Mutex_Unlock(&d->lock);
+			poll_notify(&cb->pollq);
 		}
 
 		// If it's a listener
 		if (cb->type == LISTENER)
 		{
-			PORT_MAP[cb->port] = NULL;			 // Take it out of the port table
-			kernel_broadcast(&cb->listener.req); // Wake it up
+			sockLis *l = &cb->listener;
+			rlnode pool;
+			rlnode_init(&pool, NULL);
+
+			Mutex_Lock(&port_lock);
+			// Take it out of the port table, and out of the ring of the port
+			if (PORT_MAP[cb->port] == cb)
+				PORT_MAP[cb->port] = (l->group.next != &l->group) ? l->group.next->obj : NULL;
+			rlist_remove(&l->group);
+			l->closed = 1;
+			kernel_broadcast(&l->req); // Wake it up
+
+			// The pending Connect calls fail
+			for (rlnode *n = l->request_queue.next; n != &l->request_queue; n = n->next)
+				kernel_signal(&((qNode *)n->obj)->cv);
+
+			// The accepted connections no longer return their pipes to us
+			while (!is_rlist_empty(&l->active))
+				((pipePair *)rlist_pop_front(&l->active)->obj)->listener = NULL;
+			rlist_append(&pool, &l->pool);
+			l->pooled = 0;
+
+			release_slots(l);
+			Mutex_Unlock(&port_lock);
+
+			while (!is_rlist_empty(&pool))
+				free_pipe_pair(rlist_pop_front(&pool)->obj);
 		}
 		cb = NULL;
 		return 0;
@@ -84,7 +348,7 @@ int socket_close(void *this)
 	return NOFILE;
 }
 
-Fid_t sys_Socket(port_t port)
+static Fid_t create_socket(port_t port, int packet)
 {
 	// Returns a new socket bound on a port
 
@@ -97,45 +361,88 @@ Fid_t sys_Socket(port_t port)
 	// Local FID and FCB arrays
 	Fid_t fid[1];
 	FCB *fcb[1];
-	// Dynamic allocation of the socket
-	socketCB *cb = (socketCB *)xmalloc(sizeof(socketCB));
 	// We get an FCB
 	int reservedFCB = FCB_reserve(1, fid, fcb);
 	// If it can't reserve the FCB it fails
 	if (!reservedFCB)
 		return NOFILE;
+	// Dynamic allocation of the socket
+	socketCB *cb = (socketCB *)xmalloc(sizeof(socketCB));
 
 	// Point our socket port to the one given
 	cb->port = port;
 	// Make the socket type unbound
 	cb->type = UNBOUND;
+	cb->packet = packet;
+	poll_queue_init(&cb->pollq);
 
 	// We point out FCB's stream object to our socket
 	fcb[0]->streamobj = cb;
 	// And the stream functions to our defined socket function struct
 	fcb[0]->streamfunc = &socket_file_ops;
 
-	// If our port already has something
-	if (PORT_MAP[port] != NULL)
-	{
-		// Return the FID
-		return fid[0];
-	}
-	// Else place the socket on the table
-	PORT_MAP[port] = cb;
+	Mutex_Lock(&port_lock);
+	// If our port doesn't have anything, place the socket on the table
+	if (PORT_MAP[port] == NULL)
+		PORT_MAP[port] = cb;
+	Mutex_Unlock(&port_lock);
+
 	// And return the FID
 	return fid[0];
 }
 
+Fid_t sys_Socket(port_t port)
+{
+	return create_socket(port, 0);
+}
+
+Fid_t sys_PacketSocket(port_t port)
+{
+	return create_socket(port, 1);
+}
+
+int sys_SocketPair(Fid_t sock[2])
+{
+	// Returns two sockets connected to each other, without going through a
+	// port, a listener and a connection request
+
+	Fid_t fid[2];
+	FCB *fcb[2];
+
+	if (!FCB_reserve(2, fid, fcb))
+		return -1;
+
+	socketCB *cb[2];
+	for (int i = 0; i < 2; i++)
+	{
+		cb[i] = (socketCB *)xmalloc(sizeof(socketCB));
+		cb[i]->port = NOPORT;
+		cb[i]->type = UNBOUND;
+		cb[i]->packet = 0;
+		poll_queue_init(&cb[i]->pollq);
+		fcb[i]->streamobj = cb[i];
+		fcb[i]->streamfunc = &socket_file_ops;
+	}
+
+	// Nobody else can see the sockets yet, so the port table is not locked
+	connect_peers(cb[0], fid[0], cb[1], fid[1], alloc_pipe_pair(0));
+
+	sock[0] = fid[0];
+	sock[1] = fid[1];
+	return 0;
+}
+
 int sys_Listen(Fid_t sock)
 {
-	// Here we turn our unbound socket into a listening socket
+	return sys_ListenBacklog(sock, DEFAULT_BACKLOG);
+}
 
-	// We grab the FCB pointing to the FID given
-	FCB *fcb = get_fcb(sock);
+static int socket_listen(FCB *fcb, unsigned int backlog, int shared)
+{
+	// Here we turn our unbound socket into a listening socket
 
-	// If the FCB exists and it has functions
-	if (fcb != NULL && fcb->streamfunc == &socket_file_ops)
+	// If the FCB has socket functions
+	if (fcb->streamfunc == &socket_file_ops)
 	{
 
 		// We grab the socket from the FCB
@@ -144,138 +451,235 @@ int sys_Listen(Fid_t sock)
 		if (cb == NULL) // The socket doesn't exist
 			return -1;
 
-		if (cb->type != UNBOUND) // The socket isn't unbound
+		if (cb->port <= NOPORT || cb->port > MAX_PORT) // Port's not inside the range
 			return -1;
 
-		if ((PORT_MAP[cb->port])->type == LISTENER) // Is already a listener
+		if (backlog == 0)
 			return -1;
+		if (backlog > MAX_BACKLOG)
+			backlog = MAX_BACKLOG;
 
-		if (cb->port <= NOPORT || cb->port > MAX_PORT) // Port's not inside the range
+		Mutex_Lock(&port_lock);
+
+		socketCB *other = PORT_MAP[cb->port];
+		if (other != NULL && other->type != LISTENER)
+			other = NULL; // Only unbound sockets there
+
+		if (cb->type != UNBOUND || // The socket isn't unbound
+			(other != NULL && // Is already a listener, and we can't share it
+			 (!shared || !other->listener.shared || other->packet != cb->packet)))
+		{
+			Mutex_Unlock(&port_lock);
 			return -1;
+		}
 
-		// Make the socket's type a listener
-		cb->type = LISTENER;
 		// Initialize our CondVar that is for checking if we have a new request on our list
 		cb->listener.req = COND_INIT;
 		// Initialize the queue on unionTypeListener
 		rlnode_init(&(cb->listener.request_queue), NULL);
 
+		// Preallocate the backlog: the queue nodes and the pipe pairs
+		sockLis *l = &cb->listener;
+		l->backlog = backlog;
+		l->pending = 0;
+		l->closed = 0;
+		l->slots = (qNode *)xmalloc(backlog * sizeof(qNode));
+		rlnode_init(&l->free_slots, NULL);
+		rlnode_init(&l->pool, NULL);
+		rlnode_init(&l->active, NULL);
+		for (uint i = 0; i < backlog; i++)
+		{
+			rlnode_init(&l->slots[i].node, &l->slots[i]);
+			l->slots[i].cv = COND_INIT;
+			rlist_push_back(&l->free_slots, &l->slots[i].node);
+
+			pipePair *pair = alloc_accept_pair(cb->packet);
+			rlist_push_back(&l->pool, &pair->node);
+		}
+		l->pooled = backlog;
+		l->queued = 0;
+		l->shared = shared;
+		rlnode_init(&l->group, cb);
+
+		// Make the socket's type a listener, and the owner of the port (or
+		// the last one of the listeners that share it)
+		cb->type = LISTENER;
+		if (other != NULL)
+			rlist_push_back(&other->listener.group, &l->group);
+		else
+			PORT_MAP[cb->port] = cb;
+
+		Mutex_Unlock(&port_lock);
 		return 0; // All went well
 	}
 	return -1; // Something went wrong
 }
 
+static int listen_socket(Fid_t sock, unsigned int backlog, int shared)
+{
+	// The reference keeps the socket open while we use it
+	FCB *fcb = get_fcb_ref(sock);
+	if (fcb == NULL)
+		return -1;
+	int ret = socket_listen(fcb, backlog, shared);
+	FCB_decref(fcb);
+	return ret;
+}
+
+int sys_ListenBacklog(Fid_t sock, unsigned int backlog)
+{
+	return listen_socket(sock, backlog, 0);
+}
+
+int sys_ListenShared(Fid_t sock, unsigned int backlog)
+{
+	return listen_socket(sock, backlog, 1);
+}
+
 Fid_t sys_Accept(Fid_t lsock)
 {
 	// Waits for a connection
 
-	// We grab the FCB pointing to the FID given
-	FCB *fcb = get_fcb(lsock);
+	// We grab the FCB pointing to the FID given, with a reference
+	FCB *fcb = get_fcb_ref(lsock);
+	if (fcb == NULL)
+		return -1;
 
-	// If the FCB exists and it has functions
-	if (fcb != NULL && fcb->streamfunc == &socket_file_ops)
-	{
+	Fid_t err = -1;
 
-		// We grab the socket from the FCB
-		socketCB *cb = fcb->streamobj;
+	// If it does not have socket functions
+	if (fcb->streamfunc != &socket_file_ops)
+		goto done;
 
-		if (cb == NULL) // The socket doesn't exist
-			return -1;
+	// We grab the socket from the FCB
+	socketCB *cb = fcb->streamobj;
+	int nonblock = fcb->nonblock;
 
-		if (cb->port <= NOPORT || cb->port > MAX_PORT) // Port's not inside the range
-			return -1;
+	if (cb->port <= NOPORT || cb->port > MAX_PORT) // Port's not inside the range
+		goto done;
 
-		if ((PORT_MAP[cb->port])->type != LISTENER) // Not pointing to a listener
-			return -1;
+	if (cb->type != LISTENER) // Not a listener
+		goto done;
 
-		if (cb->type == PEER) // Port is already connected
-			return -1;
+	// In non-blocking mode, we do not make a peer unless there is a request
+	if (nonblock && __atomic_load_n(&cb->listener.queued, __ATOMIC_SEQ_CST) == 0)
+	{
+		err = WOULD_BLOCK;
+		goto done;
+	}
+
+	// We reserve the FCB of the peer before locking the port table. Its socket
+	// comes with the pipes of the connection, and until then nobody can use it
+	Fid_t peerID;
+	FCB *peerFCB;
+	if (!FCB_reserve(1, &peerID, &peerFCB))
+		goto done;
+
+	// A waiting Accept does not keep the listener open, else closing it would
+	// not wake us up (see kernel_socket.h). From here on, we only use its socketCB
+	FCB_decref(fcb);
 
-		socketCB *l = PORT_MAP[cb->port];
+	Mutex_Lock(&port_lock);
 
-		// While the request list is empty
-		while (is_rlist_empty(&(PORT_MAP[cb->port]->listener.request_queue)))
+	socketCB *l = cb;
+
+	if (l->listener.closed) // Closed by another thread
+		goto fail;
+
+	// While the request list is empty
+	while (is_rlist_empty(&(l->listener.request_queue)))
+	{
+		if (nonblock) // Another Accept took the request
 		{
-			kernel_wait(&(PORT_MAP[cb->port]->listener.req), SCHED_USER); // Wait for a request to wake it up
-			if (PORT_MAP[cb->port] == NULL)
-				return -1;
+			err = WOULD_BLOCK;
+			goto fail;
 		}
+		kernel_wait(&port_lock, &(l->listener.req), SCHED_USER); // Wait for a request to wake it up
+		if (l->listener.closed)
+			goto fail;
+	}
 
-		// From here and on the request CondVar of our listener has woken up
+	// From here and on the request CondVar of our listener has woken up
+
+	// We pop the first node from the request list of socket "l"
+	rlnode *requestNode = rlist_pop_front(&(l->listener.request_queue));
+	l->listener.queued--;
+	// If more requests are waiting, pass them on to another Accept
+	if (!is_rlist_empty(&(l->listener.request_queue)))
+		kernel_signal(&(l->listener.req));
+	// We grab the qNode type Struct from the rlNode
+	qNode *reqNode = requestNode->obj;
+	// Grab the peer from it
+	socketCB *reqPeer = reqNode->reqSock;
+	// And its FID to properly connect the pipes
+	Fid_t reqPeerID = reqNode->fid;
+
+	// The pipes and the peer (of the same mode) come from the pool, unless all
+	// of them are in use
+	pipePair *pair;
+	if (!is_rlist_empty(&l->listener.pool))
+	{
+		pair = rlist_pop_front(&l->listener.pool)->obj;
+		l->listener.pooled--;
+	}
+	else
+		pair = alloc_accept_pair(l->packet);
+	pair->listener = l;
+	rlist_push_back(&l->listener.active, &pair->node);
 
-		// We create a peer to unite with our listener
-		Fid_t peerID = sys_Socket(cb->port);
+	socketCB *peer = pair->sock;
+	peer->port = l->port;
+	peer->type = UNBOUND;
+	peer->packet = l->packet;
+	poll_queue_init(&peer->pollq);
 
-		if (peerID == NOFILE)
-			return -1;
+	// We create the connection
+	connect_peers(peer, peerID, reqPeer, reqPeerID, pair);
 
-		// We grab the FCB for our new socket
-		FCB *peerFCB = get_fcb(peerID);
-		// Then we grab the socket of our new FCB
-		socketCB *peer = peerFCB->streamobj;
-
-		// We pop the first node from the request list of socket "l"
-		rlnode *requestNode = rlist_pop_front(&(l->listener.request_queue));
-		// We grab the qNode type Struct from the rlNode
-		qNode *reqNode = requestNode->obj;
-		// Grab the peer from it
-		socketCB *reqPeer = reqNode->reqSock;
-		// And its FID to properly connect the pipes
-		Fid_t reqPeerID = reqNode->fid;
-
-		if (reqPeer == NULL || peer == NULL) // If any of the peers don't exist if fails
-			return -1;
+	// We honor the connection request
+	reqNode->admitted = 1;
 
-		// After creating the 2 peers, we will create the 2 pipes
-
-		// Pipe 1
-		pipe_cb *pipe1 = (pipe_cb *)xmalloc(sizeof(pipe_cb));
-		pipe1->pit.read = reqPeerID;
-		pipe1->pit.write = peerID;
-		pipe1->r_position = 0;
-		pipe1->w_position = 0;
-		pipe1->has_space = COND_INIT;
-		pipe1->has_data = COND_INIT;
-		// Pipe 2
-		pipe_cb *pipe2 = (pipe_cb *)xmalloc(sizeof(pipe_cb));
-		pipe2->pit.read = peerID;
-		pipe2->pit.write = reqPeerID;
-		pipe2->r_position = 0;
-		pipe2->w_position = 0;
-		pipe2->has_space = COND_INIT;
-		pipe2->has_data = COND_INIT;
-
-		// As long as the pipes are fine, we create the connection
-		if (pipe1 != NULL && pipe2 != NULL)
-		{
-			peer->type = PEER;
-			peer->peer.readPipe = pipe2;
-			peer->peer.writePipe = pipe1;
+	// We signal the new condition to the waiter
+	kernel_signal(&(reqNode->cv));
 
-			reqPeer->type = PEER;
-			reqPeer->peer.readPipe = pipe1;
-			reqPeer->peer.writePipe = pipe2;
-		}
+	Mutex_Unlock(&port_lock);
 
-		// We honor the connection request
-		reqNode->admitted = 1;
+	// Now the peer can be used
+	peerFCB->streamobj = peer;
+	peerFCB->streamfunc = &socket_file_ops;
+	return peerID;
 
-		// We signal the new condition to the waiter
-		kernel_signal(&(reqNode->cv));
+fail:
+	Mutex_Unlock(&port_lock);
+	FCB_unreserve(1, &peerID, &peerFCB);
+	return err;
 
-		return peerID;
-	}
-	return -1;
+done:
+	FCB_decref(fcb);
+	return err;
 }
 
-int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
+// Pick the listener of a port with the fewest queued requests, and a free slot in
+// its backlog. Ties go to the first one in the ring. Called with the port table locked
+static socketCB *pick_listener(socketCB *first)
+{
+	socketCB *best = NULL;
+	rlnode *n = &first->listener.group;
+	do
+	{
+		socketCB *l = n->obj;
+		if (!is_rlist_empty(&l->listener.free_slots) &&
+			(best == NULL || l->listener.queued < best->listener.queued))
+			best = l;
+		n = n->next;
+	} while (n != &first->listener.group);
+	return best;
+}
+
+static int socket_connect(FCB *fcb, Fid_t sock, port_t port, timeout_t timeout)
 {
-	// Grab the FCB of the FID given
-	FCB *fcb = get_fcb(sock);
 	int timedOut; // Variable so we don't wait for the connection endlessly
 
-	if (fcb == NULL) // FCB doesn't exist
-		return -1;
 	if (fcb->streamfunc != &socket_file_ops) // Not connected to the socket functions
 		return -1;
 	if (port <= NOPORT || port > MAX_PORT) // Port out of bounds
@@ -283,53 +687,85 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 
 	// Grab the socket of the FCB
 	socketCB *peer = fcb->streamobj;
+
+	Mutex_Lock(&port_lock);
+
 	// Get the Lsocket of the port
 	socketCB *listener = PORT_MAP[port];
 
-	if (peer->type != UNBOUND) // Socket already in use
-		return -1;
-	if (listener == NULL) // Listener doesn't exist
-		return -1;
-	if (listener->type != LISTENER) // Socket is there but it's not a listener
+	if (peer->type != UNBOUND || // Socket already in use
+		listener == NULL ||		 // Listener doesn't exist
+		listener->type != LISTENER || // Socket is there but it's not a listener
+		listener->packet != peer->packet || // Stream and packet sockets don't mix
+		(listener = pick_listener(listener)) == NULL) // The backlog is full
+	{
+		Mutex_Unlock(&port_lock);
 		return -1;
+	}
+
+	// The next Connect starts looking from the next listener
+	PORT_MAP[port] = listener->listener.group.next->obj;
 
-	// Dynamically allocating reqNode
-	qNode *node = (qNode *)xmalloc(sizeof(qNode));
+	// Take a request node from the backlog
+	qNode *node = rlist_pop_front(&listener->listener.free_slots)->obj;
+	listener->listener.pending++;
 	// Socket of reqNode points to the peer
 	node->reqSock = peer;
 	// We use the fid of the requester to connect the pipes
 	node->fid = sock;
-	// Initialize the queue
-	rlnode_init(&node->node, node);
 	// Listener not yet ready so we set it to 0
 	node->admitted = 0;
-	// Initializing the condition variable
-	node->cv = COND_INIT;
 	// Place the request node to the listener's list
-	rlist_push_back(&(PORT_MAP[port]->listener.request_queue), &node->node);
+	rlist_push_back(&(listener->listener.request_queue), &node->node);
+	listener->listener.queued++;
 
-	// Wake up the listener to make the connection
-	kernel_broadcast(&(PORT_MAP[port]->listener.req));
+	// Wake up one Accept of the listener to make the connection
+	kernel_signal(&(listener->listener.req));
+	poll_notify(&listener->pollq);
 
 	// While there's no response
 	while (node->admitted == 0)
 	{
 		// We make sure there's a timeout at some point
-		timedOut = kernel_timedwait(&node->cv, SCHED_PIPE, timeout);
-		if (!timedOut) // Timeout occured
-			return -1;
+		timedOut = kernel_timedwait(&port_lock, &node->cv, SCHED_PIPE, timeout);
+		if (!timedOut || listener->listener.closed) // Timeout occured, or the listener is gone
+			break;
 	}
 
-	// Not yet needed
-	node = NULL;
-	return 0;
+	int ret = node->admitted ? 0 : -1;
+
+	// If we were not admitted, the request is still in the listener's list
+	if (!node->admitted)
+	{
+		rlist_remove(&node->node);
+		listener->listener.queued--;
+	}
+
+	// Give the request node back
+	listener->listener.pending--;
+	if (listener->listener.closed)
+		release_slots(&listener->listener);
+	else
+		rlist_push_back(&listener->listener.free_slots, &node->node);
+
+	Mutex_Unlock(&port_lock);
+	return ret;
 }
 
-int sys_ShutDown(Fid_t sock, shutdown_mode how)
+int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 {
-	FCB *fcb = get_fcb(sock);
-	if (fcb == NULL) // Bad FCB
+	// The reference keeps the socket open while we wait, so that the
+	// listener can connect it
+	FCB *fcb = get_fcb_ref(sock);
+	if (fcb == NULL)
 		return -1;
+	int ret = socket_connect(fcb, sock, port, timeout);
+	FCB_decref(fcb);
+	return ret;
+}
+
+static int socket_shutdown(FCB *fcb, shutdown_mode how)
+{
 	if (fcb->streamfunc != &socket_file_ops) // Wrong funcs
 		return -1;
 	if (how < 1 || how > 3) // Bad mode
@@ -342,15 +778,15 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 		int r, w;
 		switch (how) // Case on shutdown mode
 		{
-		case SHUTDOWN_READ: // We use pipe_reader_close() to close socket's reader_pipe
-			return pipe_reader_close(cb->peer.readPipe);
+		case SHUTDOWN_READ: // We use pipe_shutdown_reader() to close socket's reader_pipe
+			return pipe_shutdown_reader(cb->peer.readPipe);
 			break;
-		case SHUTDOWN_WRITE: // We use pipe_writer_close() to close socket’s writer_pipe
-			return pipe_writer_close(cb->peer.writePipe);
+		case SHUTDOWN_WRITE: // We use pipe_shutdown_writer() to close socket’s writer_pipe
+			return pipe_shutdown_writer(cb->peer.writePipe);
 			break;
 		case SHUTDOWN_BOTH: // Close both of them
-			r = pipe_reader_close(cb->peer.readPipe);
-			w = pipe_writer_close(cb->peer.writePipe);
+			r = pipe_shutdown_reader(cb->peer.readPipe);
+			w = pipe_shutdown_writer(cb->peer.writePipe);
 			if ((r + w) == 0) // Check if it was done properly
 				return 0;
 			else
@@ -363,3 +799,120 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 	}
 	return -1;
 }
+
+int sys_ShutDown(Fid_t sock, shutdown_mode how)
+{
+	FCB *fcb = get_fcb_ref(sock);
+	if (fcb == NULL) // Bad FCB
+		return -1;
+	int ret = socket_shutdown(fcb, how);
+	FCB_decref(fcb);
+	return ret;
+}
+
+Fid_t sys_DatagramSocket(port_t port)
+{
+	if (port < NOPORT || port > MAX_PORT)
+		return NOFILE;
+
+	Fid_t fid[1];
+	FCB *fcb[1];
+	if (!FCB_reserve(1, fid, fcb))
+		return NOFILE;
+
+	socketCB *cb = (socketCB *)xmalloc(sizeof(socketCB));
+	cb->port = port;
+	cb->type = DGRAM;
+	cb->packet = 0;
+	poll_queue_init(&cb->pollq);
+	rlnode_init(&cb->dgram.queue, NULL);
+	cb->dgram.bytes = 0;
+	cb->dgram.lock = MUTEX_INIT;
+	cb->dgram.has_data = COND_INIT;
+	cb->dgram.closed = 0;
+
+	// Bind the port, unless another datagram socket has it
+	if (port != NOPORT)
+	{
+		Mutex_Lock(&port_lock);
+		if (DGRAM_MAP[port] != NULL)
+		{
+			Mutex_Unlock(&port_lock);
+			FCB_unreserve(1, fid, fcb);
+			free(cb);
+			return NOFILE;
+		}
+		__atomic_store_n(&DGRAM_MAP[port], cb, __ATOMIC_RELEASE);
+		Mutex_Unlock(&port_lock);
+	}
+
+	fcb[0]->streamobj = cb;
+	fcb[0]->streamfunc = &socket_file_ops;
+	return fid[0];
+}
+
+// Get the FCB of a datagram socket with a reference, or NULL
+static FCB *get_dgram_fcb(Fid_t sock)
+{
+	FCB *fcb = get_fcb_ref(sock);
+	if (fcb == NULL)
+		return NULL;
+	if (fcb->streamfunc != &socket_file_ops || ((socketCB *)fcb->streamobj)->type != DGRAM)
+	{
+		FCB_decref(fcb);
+		return NULL;
+	}
+	return fcb;
+}
+
+int sys_SendTo(Fid_t sock, const char *buf, unsigned int size, port_t port)
+{
+	if (size > MAX_DATAGRAM || port <= NOPORT || port > MAX_PORT)
+		return -1;
+
+	FCB *fcb = get_dgram_fcb(sock);
+	if (fcb == NULL)
+		return -1;
+	port_t from = ((socketCB *)fcb->streamobj)->port;
+	FCB_decref(fcb);
+
+	// The port table is not locked: sockets are never freed, and a closed
+	// one does not take datagrams
+	socketCB *to = __atomic_load_n(&DGRAM_MAP[port], __ATOMIC_ACQUIRE);
+	if (to == NULL)
+		return -1;
+	sockDgram *d = &to->dgram;
+
+	// The datagram is copied before the queue is locked
+	datagram *msg = (datagram *)xmalloc(sizeof(datagram) + size);
+	msg->from = from;
+	msg->size = size;
+	rlnode_init(&msg->node, msg);
+	memcpy(msg->data, buf, size);
+
+	Mutex_Lock(&d->lock);
+	if (d->closed || d->bytes + sizeof(datagram) + size > DGRAM_QUEUE_BYTES)
+	{
+		Mutex_Unlock(&d->lock);
+		free(msg);
+		return -1;
+	}
+	rlist_push_back(&d->queue, &msg->node);
+	d->bytes += sizeof(datagram) + size;
+	kernel_signal(&d->has_data);
+	Mutex_Unlock(&d->lock);
+	poll_notify(&to->pollq);
+	return size;
+}
+
+int sys_RecvFrom(Fid_t sock, char *buf, unsigned int size, port_t *port)
+{
+	// The reference keeps the socket open while we wait
+	FCB *fcb = get_dgram_fcb(sock);
+	if (fcb == NULL)
+		return -1;
+	iovec_t iov = {buf, size};
+	int ret = dgram_recv(fcb->streamobj, &iov, 1, port, fcb->nonblock);
+	FCB_decref(fcb);
+	return ret;
+}
@@ -8,24 +8,96 @@ A socket can be:
 				- A listener if it listens
 				- A peer if it's connected (maybe a listener at the same time)
 				- Unbound if it's not connected
+
+The socket system calls hold a reference to the FCB of their socket (see
+get_fcb_ref()), so that another thread cannot close it while they use it.
+Only a waiting Accept drops its reference to the listener before it sleeps,
+so that closing the listener wakes it up; from then on it only uses the
+socketCB of the listener, which is never freed, and checks its closed flag
+under the port table lock.
+*/
+/*
+The two pipes of a connection. They are shared by the two peers, and once both
+peers are closed they go back to the pool of the listener that accepted the
+connection (or they are freed). The socket of the accepting end goes with them.
 */
+typedef struct pipe_pair
+{
+	pipe_cb *pipe[2];
+	int users; // The peers that are not closed yet
+	struct socket_control_block *listener; // Whose pool the pair returns to, or NULL
+	struct socket_control_block *sock; // The accepting end, or NULL if not made by a listener
+	rlnode node; // In the pool or in the active list of the listener
+} pipePair;
+
 typedef struct peer_socket
 {
 	pipe_cb *readPipe;
 	pipe_cb *writePipe;
+	pipePair *pair;
 } sockPee;
 
+/*
+A listener preallocates its backlog: a queue node for every Connect that may be
+pending, and a pipe pair (with the socket of the accepting end) for every
+connection it may accept without waiting for the old ones to close. Beyond
+that, Accept allocates them, and they are freed when the connection closes.
+
+The pipes in the pool are not charged to any process, so a large backlog does
+not eat into the MAX_PIPE_MEMORY of the listener's process. The pipes of a
+connection are charged to the process that accepted it (or that called
+SocketPair()), even over the limit, and they stop being charged when they go
+back to the pool.
+
+Listeners made by ListenShared() may share a port. The listeners of a port form
+a ring, and PORT_MAP points to the one Connect looks at first.
+*/
 typedef struct listener_socket
 {
 	rlnode request_queue;
 	CondVar req;
+	struct queue_node *slots; // The queue nodes of the backlog
+	rlnode free_slots;
+	uint backlog;
+	uint pending; // Slots taken by Connect calls
+	rlnode pool;  // Pipe pairs ready for Accept
+	uint pooled;
+	rlnode active; // Pipe pairs of accepted connections
+	int closed;
+	uint queued;  // Requests in request_queue
+	int shared;	  // Made by ListenShared()
+	rlnode group; // The ring of the listeners of the port
 } sockLis;
 
+/*
+A datagram socket has a bounded queue of the datagrams sent to it. The queue has
+its own lock, so that senders to different sockets do not contend.
+*/
+#define DGRAM_QUEUE_BYTES (64 * 1024) /* The queue memory of a datagram socket, headers included */
+
+typedef struct datagram
+{
+	port_t from;
+	uint size;
+	rlnode node;
+	char data[];
+} datagram;
+
+typedef struct datagram_socket
+{
+	rlnode queue;
+	uint bytes; // The memory of the datagrams in queue
+	Mutex lock;
+	CondVar has_data;
+	int closed;
+} sockDgram;
+
 typedef enum socket_state
 {
 	UNBOUND,
 	PEER,
-	LISTENER
+	LISTENER,
+	DGRAM
 } sockType;
 
 
@@ -33,11 +105,14 @@ typedef struct socket_control_block
 {
 	sockType type;
 	port_t port;
+	int packet; // A packet socket only connects with packet sockets, over packet pipes
+	poll_queue pollq; // Notified when it connects, and when a listener or datagram socket gets data
 
 	union
 	{
 		sockLis listener;
 		sockPee peer;
+		sockDgram dgram;
 	};
 
 } socketCB;
@@ -47,14 +122,17 @@ typedef struct queue_node
 {
 	Fid_t fid; 
 	socketCB *reqSock;
-	rlnode node;
+	rlnode node; // In the request queue, or in the free slots of the listener
 	CondVar cv;
 	int admitted;
 } qNode;
 
 
 socketCB *PORT_MAP[MAX_PORT + 1] = {NULL};
+socketCB *DGRAM_MAP[MAX_PORT + 1] = {NULL}; /* The datagram sockets, they have their own ports */
 
 int socket_read(void *this, char *buf, unsigned int size);
 int socket_write(void *this, const char *buf, unsigned int size);
+int socket_readv(void *this, const iovec_t *iov, unsigned int iovcnt, int nonblock);
+int socket_writev(void *this, const iovec_t *iov, unsigned int iovcnt, int nonblock);
 int socket_close(void *this);
\ No newline at end of file
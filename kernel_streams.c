@@ -1,16 +1,22 @@
 
+#include <limits.h>
 #include "util.h"
 #include "tinyos.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_pipe.h"
+#include "kernel_events.h"
 
 #define MAX_FILES MAX_PROC
 
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/* Protects the FCB_freelist */
+static Mutex fcb_lock = MUTEX_INIT;
+
 
 void initialize_files()
 {
@@ -26,32 +32,43 @@ void initialize_files()
 
 FCB* acquire_FCB()
 {
+  FCB* fcb = NULL;
+
+  Mutex_Lock(&fcb_lock);
   if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
-    return fcb;
+    fcb->streamobj = NULL;
+    fcb->streamfunc = NULL;
+    fcb->nonblock = 0;
+    rlnode_init(&fcb->watches, NULL);
   }
-  else
-    return NULL;
+  Mutex_Unlock(&fcb_lock);
+
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
+  Mutex_Lock(&fcb_lock);
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  Mutex_Unlock(&fcb_lock);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
+    /* Nobody else can add a watch now, since they need a reference */
+    if(! is_rlist_empty(&fcb->watches))
+      event_forget(fcb);
     int retval = fcb->streamfunc->Close(fcb->streamobj);
     release_FCB(fcb);
     return retval;
@@ -68,6 +85,8 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     size_t f=0;
     uint i;
 
+    Mutex_Lock(&cur->fidt_lock);
+
     /* Find distinct fids */
     for(i=0; i<num; i++) {
 	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
@@ -75,7 +94,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto fail;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,14 +105,19 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto fail;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
     }
+    Mutex_Unlock(&cur->fidt_lock);
     return 1;
+
+fail:
+    Mutex_Unlock(&cur->fidt_lock);
+    return 0;
 }
 
 
@@ -101,11 +125,13 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&cur->fidt_lock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&cur->fidt_lock);
 }
 
 
@@ -128,6 +154,36 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
+FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->fidt_lock);
+  FCB* fcb = cur->FIDT[fid];
+  /* Skip FCBs that are reserved, but not yet initialized */
+  if(fcb != NULL && fcb->streamfunc != NULL)
+    FCB_incref(fcb);
+  else
+    fcb = NULL;
+  Mutex_Unlock(&cur->fidt_lock);
+
+  return fcb;
+}
+
+
+/*
+  A non-blocking transfer on a stream without ReadV/WriteV can only check
+  beforehand that the stream is ready. Streams that cannot be polled never wait.
+*/
+static int stream_would_block(FCB* fcb, int event)
+{
+  if(fcb->streamfunc->Poll == NULL)
+    return 0;
+  return (fcb->streamfunc->Poll(fcb->streamobj, NULL) & (event | POLL_ERROR | POLL_HANGUP)) == 0;
+}
+
+
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
@@ -135,27 +191,27 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
   void* sobj;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream. The reference makes sure that the
+     stream will not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
   
-    if(devread)
+    if(fcb->nonblock && fcb->streamfunc->ReadV) {
+      iovec_t iov = { buf, size };
+      retcode = fcb->streamfunc->ReadV(sobj, &iov, 1, 1);
+    }
+    else if(fcb->nonblock && stream_would_block(fcb, POLL_READ))
+      retcode = WOULD_BLOCK;
+    else if(devread)
       retcode = devread(sobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
   
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
-
   return retcode;
 }
 
@@ -167,20 +223,22 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   void* sobj = NULL;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream. The reference makes sure that the
+     stream will not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
 
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
-    if(devwrite)
+    if(fcb->nonblock && fcb->streamfunc->WriteV) {
+      iovec_t iov = { (char*) buf, size };
+      retcode = fcb->streamfunc->WriteV(sobj, &iov, 1, 1);
+    }
+    else if(fcb->nonblock && stream_would_block(fcb, POLL_WRITE))
+      retcode = WOULD_BLOCK;
+    else if(devwrite)
       retcode = devwrite(sobj, buf, size);
 
     /* Need to decrease the reference to FCB */
@@ -193,21 +251,215 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 }
 
 
-int sys_Close(int fd)
+/* Check the buffers of a vectored call: their number, and that their total fits in an int */
+static int iov_valid(const iovec_t* iov, unsigned int iovcnt)
+{
+  if(iovcnt > MAX_IOV || (iov == NULL && iovcnt > 0))
+    return 0;
+
+  unsigned long long total = 0;
+  for(unsigned int i = 0; i < iovcnt; i++)
+    total += iov[i].len;
+  return total <= INT_MAX;
+}
+
+
+/*
+  Vectored I/O on a stream without ReadV/WriteV operations: one call per buffer,
+  stopping at the first short transfer. An error is only returned if nothing
+  was transferred.
+*/
+static int readv_each(FCB* fcb, const iovec_t* iov, unsigned int iovcnt)
+{
+  int (*devread)(void*,char*,uint) = fcb->streamfunc->Read;
+  if(devread == NULL)
+    return -1;
+  if(fcb->nonblock && stream_would_block(fcb, POLL_READ))
+    return WOULD_BLOCK;
+
+  int total = 0;
+  for(unsigned int i = 0; i < iovcnt; i++) {
+    if(iov[i].len == 0) continue;
+    int rc = devread(fcb->streamobj, iov[i].buf, iov[i].len);
+    if(rc < 0)
+      return (total > 0) ? total : -1;
+    total += rc;
+    if((unsigned int)rc < iov[i].len) break;
+  }
+  return total;
+}
+
+static int writev_each(FCB* fcb, const iovec_t* iov, unsigned int iovcnt)
+{
+  int (*devwrite)(void*, const char*, uint) = fcb->streamfunc->Write;
+  if(devwrite == NULL)
+    return -1;
+  if(fcb->nonblock && stream_would_block(fcb, POLL_WRITE))
+    return WOULD_BLOCK;
+
+  int total = 0;
+  for(unsigned int i = 0; i < iovcnt; i++) {
+    if(iov[i].len == 0) continue;
+    int rc = devwrite(fcb->streamobj, iov[i].buf, iov[i].len);
+    if(rc < 0)
+      return (total > 0) ? total : -1;
+    total += rc;
+    if((unsigned int)rc < iov[i].len) break;
+  }
+  return total;
+}
+
+
+int sys_ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  if(! iov_valid(iov, iovcnt))
+    return -1;
+
+  int retcode = -1;
+  FCB* fcb = get_fcb_ref(fd);
+
+  if(fcb) {
+    if(fcb->streamfunc->ReadV)
+      retcode = fcb->streamfunc->ReadV(fcb->streamobj, iov, iovcnt, fcb->nonblock);
+    else
+      retcode = readv_each(fcb, iov, iovcnt);
+
+    FCB_decref(fcb);
+  }
+
+  return retcode;
+}
+
+
+int sys_WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
 {
-  int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  if(! iov_valid(iov, iovcnt))
+    return -1;
 
-  FCB* fcb = get_fcb(fd);
+  int retcode = -1;
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
-    retcode = FCB_decref(fcb);    
+    if(fcb->streamfunc->WriteV)
+      retcode = fcb->streamfunc->WriteV(fcb->streamobj, iov, iovcnt, fcb->nonblock);
+    else
+      retcode = writev_each(fcb, iov, iovcnt);
+
+    FCB_decref(fcb);
   }
 
   return retcode;
 }
 
 
+int sys_SetNonBlocking(Fid_t fd, int on)
+{
+  FCB* fcb = get_fcb_ref(fd);
+  if(fcb == NULL)
+    return -1;
+
+  fcb->nonblock = (on != 0);
+  FCB_decref(fcb);
+  return 0;
+}
+
+
+/* 
+  Move data by reading into a kernel buffer, and writing all of it out.
+  This is how Splice works between streams that are not both pipes.
+
+  Nothing is read unless the output can take all of it: a stream with pipes
+  but no pipe to write to (e.g., an unconnected socket) fails at once, and
+  a pipe must first have room for what we read. The other streams (the
+  terminals and the null device) always take what is written.
+*/
+static int splice_copy(FCB* in, FCB* out, unsigned int size)
+{
+  int (*devread)(void*,char*,uint) = in->streamfunc->Read;
+  int (*devwrite)(void*, const char*, uint) = out->streamfunc->Write;
+  if(devread == NULL || devwrite == NULL)
+    return -1;
+
+  if(size > PIPE_BUFFER_SIZE) size = PIPE_BUFFER_SIZE;
+  if(size == 0)
+    return 0;
+
+  if(out->streamfunc->GetPipe) {
+    pipe_cb* dst = out->streamfunc->GetPipe(out->streamobj, 1);
+    if(dst == NULL)
+      return -1;
+    size = pipe_await_room(dst, size);
+    if(size == 0)
+      return -1;  /* The reader is closed */
+  }
+
+  char* buf = xmalloc(size);
+
+  int n = devread(in->streamobj, buf, size);
+  int moved = 0;
+  while(moved < n) {
+    int rc = devwrite(out->streamobj, buf+moved, n-moved);
+    if(rc <= 0) break;
+    moved += rc;
+  }
+  free(buf);
+
+  /* 
+    Only if the reader closes after we read, the rest is dropped, as it
+    would have been from the pipe. It was taken from the input all the same.
+  */
+  return n;
+}
+
+
+int sys_Splice(Fid_t fd_in, Fid_t fd_out, unsigned int size)
+{
+  int retcode = -1;
+
+  FCB* in = get_fcb_ref(fd_in);
+  FCB* out = get_fcb_ref(fd_out);
+
+  if(in && out) {
+    /* Between two distinct pipes in stream mode, copy from ring to ring */
+    pipe_cb* src = in->streamfunc->GetPipe ? in->streamfunc->GetPipe(in->streamobj, 0) : NULL;
+    pipe_cb* dst = out->streamfunc->GetPipe ? out->streamfunc->GetPipe(out->streamobj, 1) : NULL;
+
+    if(src && dst && src != dst && !src->packet && !dst->packet)
+      retcode = pipe_splice(src, dst, size);
+    else
+      retcode = splice_copy(in, out, size);
+  }
+
+  if(in) FCB_decref(in);
+  if(out) FCB_decref(out);
+  return retcode;
+}
+
+
+int sys_Close(int fd)
+{
+  if(fd<0 || fd>=MAX_FILEID) return -1;
+  int retcode = 0;  /* Closing a closed fd is legal! */
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->fidt_lock);
+  FCB* fcb = cur->FIDT[fd];
+  if(fcb != NULL && fcb->streamfunc == NULL) {
+    /* Still being opened by another thread */
+    fcb = NULL;
+    retcode = -1;
+  }
+  if(fcb)
+    cur->FIDT[fd] = NULL;
+  Mutex_Unlock(&cur->fidt_lock);
+
+  if(fcb)
+    retcode = FCB_decref(fcb);
+
+  return retcode;
+}
+
+
 /*
   Copy file descriptor oldfd into file descriptor newfd.
 
@@ -221,18 +473,28 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->fidt_lock);
+
+  FCB* old = cur->FIDT[oldfd];
+  FCB* new = cur->FIDT[newfd];
 
-  if(old==NULL) {
+  if(old==NULL || old->streamfunc==NULL || (new!=NULL && new->streamfunc==NULL)) {
     retcode = -1;
+    new = NULL;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    cur->FIDT[newfd] = old;
   }
+  else
+    new = NULL;
+
+  Mutex_Unlock(&cur->fidt_lock);
+
+  /* Close the replaced stream outside the lock */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -37,13 +37,19 @@
 	A file control block provides a uniform object to the
 	system calls, and contains pointers to device-specific
 	functions.
+
+	The reference counter is updated atomically. A reserved FCB
+	whose @c streamfunc is still NULL is not yet open; it is ignored
+	by the file id system calls until it is initialized.
  */
 typedef struct file_control_block
 {
-  uint refcount;  			/**< @brief Reference counter. */
+  uint refcount;  			/**< @brief Reference counter (atomic). */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
   rlnode freelist_node;		/**< @brief Intrusive list node */
+  rlnode watches;			/**< @brief The watches of event queues on this stream */
+  int nonblock;				/**< @brief Set by @c SetNonBlocking */
 } FCB;
 
 
@@ -122,11 +128,27 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 	This routine will return NULL if the fid is not legal.
 
+	Note that the returned FCB may be closed by another thread of
+	the process at any time. System calls that use the FCB should 
+	call @ref get_fcb_ref instead.
+
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
  */
 FCB* get_fcb(Fid_t fid);
 
+/** @brief Translate an fid to an FCB and take a reference to it.
+
+	This routine will return NULL if the fid is not legal or not open.
+	Else, the reference count of the FCB is increased, so that it 
+	cannot be released while in use. The caller must release the
+	reference by @ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
 
 /** @} */
 
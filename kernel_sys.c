@@ -9,16 +9,17 @@
 
 /*
 	Define all the syscalls 
+
+	There is no global kernel lock around system calls. Each kernel
+	subsystem does its own locking.
  */
 
 
-#define PRE_CALL \
-kernel_lock();\
+#define PRE_CALL
 
 
 
-#define POST_CALL \
-kernel_unlock();\
+#define POST_CALL
 
 
 /* with return */
@@ -32,6 +33,17 @@ RET NAME SIG \
 	return __ret;\
 }\
 
+/* 
+	Read-only: the call only reads immutable or atomically maintained 
+	state (like the current pid), so it never takes a lock and skips 
+	PRE_CALL/POST_CALL altogether.
+ */
+#define SYSCALL_RO(NAME, RET, SIG, ARGS)\
+RET NAME SIG \
+{\
+	return sys_##NAME ARGS;\
+}\
+
 /* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void NAME SIG \
@@ -44,3 +56,40 @@ void NAME SIG \
 
 SYSCALLS
 
+
+
+/*
+	A batch makes its calls directly, not through the wrappers above, 
+	so that the whole batch is a single PRE_CALL/POST_CALL.
+ */
+int sys_SysBatch(batch_op_t* ops, unsigned int n)
+{
+	if(ops==NULL || n > MAX_BATCH)
+		return -1;
+
+	int ok = 0;
+	for(unsigned int i=0; i<n; i++) {
+		batch_op_t* op = &ops[i];
+		switch(op->call) {
+		case BATCH_CLOSE:
+			op->result = sys_Close(op->fd);
+			break;
+		case BATCH_DUP2:
+			op->result = sys_Dup2(op->fd, op->newfd);
+			break;
+		case BATCH_READ:
+			op->result = sys_Read(op->fd, op->buf, op->size);
+			break;
+		case BATCH_WRITE:
+			op->result = sys_Write(op->fd, op->buf, op->size);
+			break;
+		case BATCH_EXEC:
+			op->result = sys_Exec(op->task, op->argl, op->args);
+			break;
+		default:
+			op->result = -1;
+		}
+		if(op->result >= 0) ok++;
+	}
+	return ok;
+}
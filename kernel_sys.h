@@ -7,34 +7,59 @@
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
 SYSCALLV(Exit, (int exitval), (exitval))\
-SYSCALL(GetPid, int, (void), ())\
-SYSCALL(GetPPid, int, (void), ())\
+SYSCALL_RO(GetPid, int, (void), ())\
+SYSCALL_RO(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALL(ThreadSelf, Tid_t, (void), ())\
+SYSCALL(CreateThreadStack, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
+SYSCALL_RO(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
-SYSCALL(GetTerminalDevices, unsigned int, (), ())\
+SYSCALL_RO(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
 SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL(ReadV, int, (Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd, iov, iovcnt))\
+SYSCALL(WriteV, int, (Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd, iov, iovcnt))\
+SYSCALL(SetNonBlocking, int, (Fid_t fd, int on), (fd, on))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL(Splice, int, (Fid_t fd_in, Fid_t fd_out, unsigned int size), (fd_in, fd_out, size))\
+SYSCALL(Poll, int, (pollfd_t* fds, unsigned int nfds, timeout_t timeout), (fds, nfds, timeout))\
+SYSCALL(EventQueue, Fid_t, (), ())\
+SYSCALL(EventCtl, int, (Fid_t efd, event_op op, Fid_t fd, int events), (efd, op, fd, events))\
+SYSCALL(WaitEvents, int, (Fid_t efd, event_t* events, unsigned int max, timeout_t timeout), (efd, events, max, timeout))\
+SYSCALL(IoRingSetup, Fid_t, (io_ring_t* ring, unsigned int entries), (ring, entries))\
+SYSCALL(IoRingEnter, int, (Fid_t ringfd, unsigned int min_complete, timeout_t timeout), (ringfd, min_complete, timeout))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(SetPipeCapacity, int, (Fid_t fd, unsigned int capacity), (fd, capacity))\
+SYSCALL(PacketPipe, int, (pipe_t* pipe), (pipe))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
+SYSCALL(PacketSocket, Fid_t, (port_t port), (port))\
+SYSCALL(SocketPair, int, (Fid_t sock[2]), (sock))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
+SYSCALL(ListenBacklog, int, (Fid_t sock, unsigned int backlog), (sock, backlog))\
+SYSCALL(ListenShared, int, (Fid_t sock, unsigned int backlog), (sock, backlog))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL(DatagramSocket, Fid_t, (port_t port), (port))\
+SYSCALL(SendTo, int, (Fid_t sock, const char* buf, unsigned int size, port_t port), (sock, buf, size, port))\
+SYSCALL(RecvFrom, int, (Fid_t sock, char* buf, unsigned int size, port_t* port), (sock, buf, size, port))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(SysBatch, int, (batch_op_t* ops, unsigned int n), (ops, n))\
 
 
 
 #define SYSCALL(NAME, RET, SIG, ARGS)\
 RET sys_ ## NAME SIG;
 
+/* read-only */
+#define SYSCALL_RO(NAME, RET, SIG, ARGS)\
+RET sys_ ## NAME SIG;
+
 /* without return */
 #define SYSCALLV(NAME, SIG, ARGS)\
 void sys_ ## NAME SIG;
@@ -42,6 +67,7 @@ void sys_ ## NAME SIG;
 SYSCALLS
 
 #undef SYSCALL
+#undef SYSCALL_RO
 #undef SYSCALLV
 
 #endif
\ No newline at end of file
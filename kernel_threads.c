@@ -4,6 +4,7 @@
 #include "kernel_proc.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
+#include "kernel_pipe.h"
 
 
 
@@ -22,6 +23,14 @@ void thread_initialization(){
   @brief Create a new thread in the current process.
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+  return sys_CreateThreadStack(task, argl, args, 0);
+}
+
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+  */
+Tid_t sys_CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size)
 {
   PTCB* ptcb = (PTCB*)xmalloc(sizeof(PTCB));     //Allocating space for a PTCB
   ptcb -> task = task;                           //Initializing the values once again
@@ -40,10 +49,17 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 
 
   if(ptcb-> task!= NULL) {
-    ptcb->tcb= spawn_thread(CURPROC, thread_initialization); //Creating the TCB linked to our PTCB
+    PCB* curproc = CURPROC;
+    ptcb->tcb= spawn_thread_stack(curproc, thread_initialization, stack_size); //Creating the TCB linked to our PTCB
+    if(ptcb->tcb == NULL) { //Out of memory for the thread
+      free(ptcb);
+      return NOTHREAD;
+    }
     ptcb->tcb->ptcb= ptcb;  //Linking our PTCB and TCB
-    rlist_push_back(&CURPROC->ptcb_list, &ptcb->ptcb_list_node); //Placing out PTCB in the last position of our PTCB list
-    CURPROC->thread_count++;
+    Mutex_Lock(&curproc->thread_lock);
+    rlist_push_back(&curproc->ptcb_list, &ptcb->ptcb_list_node); //Placing out PTCB in the last position of our PTCB list
+    curproc->thread_count++;
+    Mutex_Unlock(&curproc->thread_lock);
     wakeup(ptcb->tcb);
   }
 
@@ -56,7 +72,7 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
  */
 Tid_t sys_ThreadSelf()
 {
-	return (Tid_t) CURTHREAD->ptcb; //Returning the id of our PTCB
+	return (Tid_t) cur_thread()->ptcb; //Returning the id of our PTCB
 }
 
 /**
@@ -65,6 +81,8 @@ Tid_t sys_ThreadSelf()
 int sys_ThreadJoin(Tid_t tid, int* exitval)
 {
 	PTCB* ptcb = (PTCB*)tid;
+  PCB* curproc = CURPROC;
+  int ret = -1;
 
 //Multiple checks to decide if we can join the given thread
 //-We need the thread to exist
@@ -72,18 +90,20 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
 //-A thread can't join itself
 //-We check whether the thread is detached.
   
-  if(tid == NOTHREAD || (rlist_find(&CURPROC->ptcb_list,ptcb,NULL)) == NULL || tid == sys_ThreadSelf()||ptcb->detached == 1){ //search the ptcb_list for the given tid (see if it exists)
-      return -1; //If any of the above is true, of course the join attempt fails
+  Mutex_Lock(&curproc->thread_lock);
+
+  if(tid == NOTHREAD || (rlist_find(&curproc->ptcb_list,ptcb,NULL)) == NULL || tid == sys_ThreadSelf()||ptcb->detached == 1){ //search the ptcb_list for the given tid (see if it exists)
+      goto finish; //If any of the above is true, of course the join attempt fails
   }
   
   ptcb->refcount++; //We have a thread waiting
 
 //Then, as long as the thread isn't in the exited state...
   while(ptcb-> exited != 1){
-    kernel_wait(&ptcb->exit_cv,SCHED_USER); //We wait for a thread to finish
+    kernel_wait(&curproc->thread_lock, &ptcb->exit_cv,SCHED_USER); //We wait for a thread to finish
     if(ptcb -> detached == 1){
       ptcb->refcount--; //The thread is no longer waiting
-      return -1;
+      goto finish;
     }
   }
   ptcb->refcount--; //The thread is no longer waiting
@@ -97,7 +117,11 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
     rlist_remove(&ptcb->ptcb_list_node); //We remove it from the list
     free(ptcb);
   }
-    return 0;
+  ret = 0;
+
+finish:
+  Mutex_Unlock(&curproc->thread_lock);
+  return ret;
 }
 
 
@@ -108,18 +132,20 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
 int sys_ThreadDetach(Tid_t tid)
 {
 	PTCB* ptcb =NULL;
+  PCB* curproc = CURPROC;
+  Mutex_Lock(&curproc->thread_lock);
   //Searching our list based on the given tid
-  if(rlist_find(&CURPROC->ptcb_list,(PTCB*)tid,NULL)!=NULL){
+  if(rlist_find(&curproc->ptcb_list,(PTCB*)tid,NULL)!=NULL){
     ptcb=(PTCB*)tid;   //If we actually found it, we update our ptcb declared above to the one we found                      
   }
   if((ptcb==NULL) || (ptcb->exited==1)){           //We can't detach a NULL PTCB, nor an exited one
+    Mutex_Unlock(&curproc->thread_lock);
     return -1;
   }
   ptcb->detached=1;       //Given none of the above 2 checks are true, we go ahead and detach the PTCB
 
   kernel_broadcast(&ptcb->exit_cv); //Waking up all off our PTCBs
-
-
+  Mutex_Unlock(&curproc->thread_lock);
 
   return 0;
 }
@@ -131,24 +157,53 @@ void sys_ThreadExit(int exitval)
 {
   PCB *curproc=CURPROC;
   PTCB* ptcb= CURTHREAD->ptcb;
+
+  Mutex_Lock(&curproc->thread_lock);
   ptcb->exited=1;                 //Setting the current thread to the exited state
   ptcb->exitval=exitval;
-  CURPROC->thread_count--;
+  curproc->thread_count--;
 
  
   kernel_broadcast(&ptcb->exit_cv);     //Waking up all of our PTCBs
 
+  if(curproc->thread_count>0) {
+    /* Other threads remain, just leave */
+    kernel_sleep(&curproc->thread_lock, EXITED, SCHED_USER);
+  }
+  Mutex_Unlock(&curproc->thread_lock);
 
-  if(CURPROC->thread_count==0){     //If our process has no PTCBs
+  /* 
+    We are the last thread of our process. Since no other threads of the
+    process exist, we can clean up its resources without locking.
+   */
+
+  /* Release the args data */
+  if(curproc->args) {
+    free(curproc->args);
+    curproc->args = NULL;
+  }
+
+  /* Clean up FIDT */
+  for(int i=0;i<MAX_FILEID;i++) {
+    if(curproc->FIDT[i] != NULL) {
+      FCB_decref(curproc->FIDT[i]);
+      curproc->FIDT[i] = NULL;
+    }
+  }
+
+  /* Pipes that outlive us are no longer charged to us */
+  pipe_release_memory(curproc);
+
+  Mutex_Lock(&proc_lock);
 
   /* Reparent any children of the exiting process to the 
        initial task */
-    if(get_pid(CURPROC)!=1){
+  if(get_pid(curproc)!=1){
 
     PCB* initpcb = get_pcb(1);
     while(!is_rlist_empty(& curproc->children_list)) {
       rlnode* child = rlist_pop_front(& curproc->children_list);
-      child->pcb->parent = initpcb;
+      __atomic_store_n(&child->pcb->parent, initpcb, __ATOMIC_RELEASE);
       rlist_push_front(& initpcb->children_list, child);
     }
 
@@ -165,39 +220,15 @@ void sys_ThreadExit(int exitval)
 
   }
 
-  
-
   assert(is_rlist_empty(& curproc->children_list));
   assert(is_rlist_empty(& curproc->exited_list));
 
-
-  /* 
-    Do all the other cleanup we want here, close files etc. 
-   */
-
-  /* Release the args data */
-  if(curproc->args) {
-    free(curproc->args);
-    curproc->args = NULL;
-  }
-
-  /* Clean up FIDT */
-  for(int i=0;i<MAX_FILEID;i++) {
-    if(curproc->FIDT[i] != NULL) {
-      FCB_decref(curproc->FIDT[i]);
-      curproc->FIDT[i] = NULL;
-    }
-  }
-
   /* Disconnect my main_thread */
   curproc->main_thread = NULL;
 
   /* Now, mark the process as exited. */
   curproc->pstate = ZOMBIE;
 
-}
-
   /* Bye-bye cruel world */
-  kernel_sleep(EXITED, SCHED_USER);
+  kernel_sleep(&proc_lock, EXITED, SCHED_USER);
 }
-
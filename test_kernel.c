@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "util.h"
+#include "tinyos.h"
+#include "kernel_sched.h"
+
+#include "unit_testing.h"
+
+
+/* Unit tests for kernel internals, that the system calls do not show */
+
+
+static int wait_eof_task(int argl, void* args)
+{
+	char c;
+	while(Read(argl, &c, 1) > 0);
+	return 0;
+}
+
+static int ping_pong_task(int argl, void* args)
+{
+	Fid_t* fd = args;
+	char c;
+	for(int i=0; i<argl; i++) {
+		if(Read(fd[0], &c, 1)!=1) return -1;
+		if(Write(fd[1], &c, 1)!=1) return -1;
+	}
+	return 0;
+}
+
+static thread_cache_stats total_thread_cache()
+{
+	thread_cache_stats total = {0, 0, 0};
+	for(uint c=0; c<cpu_cores(); c++) {
+		thread_cache_stats s;
+		get_thread_cache_stats(c, &s);
+		total.size += s.size;
+		total.hits += s.hits;
+		total.misses += s.misses;
+	}
+	return total;
+}
+
+/*
+	The thread blocks taken from the allocator and not cached. As long as no cache
+	is trimmed (below THREAD_CACHE_HIGH blocks per core), this is the number of
+	threads not yet released, and it does not change when blocks are recycled.
+ */
+static long thread_blocks_in_use(thread_cache_stats s)
+{
+	return (long)s.misses - (long)s.size;
+}
+
+BOOT_TEST(test_thread_cache_survives_aging,
+	"Test that the per-core thread caches, and their statistics, are kept when the\n"
+	"scheduler boosts priorities (every few hundred yields)."
+	)
+{
+	/* Fill the caches with the blocks of threads that exist at once */
+	const int N = 16;
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	Tid_t tids[N];
+	for(int i=0; i<N; i++)
+		ASSERT((tids[i] = CreateThread(wait_eof_task, p.read, NULL)) != NOTHREAD);
+	Close(p.write);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	Close(p.read);
+
+	/* A joined thread is released by its core right after it switches out */
+	Poll(NULL, 0, 50);
+	thread_cache_stats before = total_thread_cache();
+	ASSERT(before.size >= N);
+
+	/* Each round trip blocks both threads, so every core passes a boost */
+	const int ROUNDS = 500;
+	pipe_t ping, pong;
+	ASSERT(Pipe(&ping)==0 && Pipe(&pong)==0);
+	Fid_t fd[2] = { ping.read, pong.write };
+	Tid_t t = CreateThread(ping_pong_task, ROUNDS, fd);
+	char c = 'x';
+	for(int i=0; i<ROUNDS; i++) {
+		ASSERT(Write(ping.write, &c, 1)==1);
+		ASSERT(Read(pong.read, &c, 1)==1);
+	}
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0 && exitval==0);
+
+	thread_cache_stats after = total_thread_cache();
+	for(int i=0; i<100 && thread_blocks_in_use(after) != thread_blocks_in_use(before); i++) {
+		Poll(NULL, 0, 10);
+		after = total_thread_cache();
+	}
+
+	/* The helper took one block and gave it back, and no block was lost */
+	ASSERT(after.hits + after.misses == before.hits + before.misses + 1);
+	ASSERT(thread_blocks_in_use(after) == thread_blocks_in_use(before));
+	return 0;
+}
+
+
+static int return_argl(int argl, void* args)
+{
+	return argl;
+}
+
+BOOT_TEST(test_create_thread_fails_without_memory,
+	"Test that CreateThreadStack returns NOTHREAD when the stack of the thread cannot\n"
+	"be mapped, instead of stopping the kernel."
+	)
+{
+	/* Leave the host process a little more address space than it uses */
+	long pages;
+	FILE* statm = fopen("/proc/self/statm", "r");
+	ASSERT(statm != NULL);
+	ASSERT(fscanf(statm, "%ld", &pages)==1);
+	fclose(statm);
+
+	struct rlimit old, low;
+	ASSERT(getrlimit(RLIMIT_AS, &old)==0);
+	low = old;
+	low.rlim_cur = pages * 4096 + THREAD_STACK_MAX / 2;
+	ASSERT(setrlimit(RLIMIT_AS, &low)==0);
+
+	Tid_t t = CreateThreadStack(return_argl, 1, NULL, THREAD_STACK_MAX);
+	ASSERT(setrlimit(RLIMIT_AS, &old)==0);
+	ASSERT(t == NOTHREAD);
+
+	/* With the memory back, it works again */
+	t = CreateThreadStack(return_argl, 2, NULL, THREAD_STACK_MAX);
+	ASSERT(t != NOTHREAD);
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==2);
+	return 0;
+}
+
+
+TEST_SUITE(sched_tests,
+	"Tests for the scheduler.")
+{
+	&test_thread_cache_survives_aging,
+	&test_create_thread_fails_without_memory,
+	NULL
+};
+
+
+TEST_SUITE(all_tests,
+	"All tests")
+{
+	&sched_tests,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	return register_test(&all_tests) ||
+		run_program(argc, argv, &all_tests);
+}
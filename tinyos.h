@@ -237,6 +237,7 @@ typedef int (*Task)(int, void*);
     On error, NOPROC is returned.
      Possible errors:
    -  The maximum number of processes has been reached.
+   -  The memory for the main thread cannot be mapped.
   */
 Pid_t Exec(Task task, int argl, void* args);
 
@@ -319,6 +320,30 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread with a given stack size.
+
+  This is the same as `CreateThread`, except that the new thread
+  gets a stack of `stack_size` bytes, instead of the default.
+  The size is rounded up to a whole number of pages, and it is
+  clamped to the limits supported by the kernel. A size of 0 selects
+  the default stack size.
+
+  Stack memory is only committed as the thread touches it, so
+  many threads with small stacks use very little memory. However,
+  each thread takes up to 3 memory areas of the host process, which
+  Linux limits to `vm.max_map_count` (65530 by default), so only
+  about 20000 threads can exist at once.
+
+  @param task a function to execute
+  @param argl the first argument of `task`
+  @param args the second argument of `task`
+  @param stack_size the requested stack size, in bytes
+  @returns the Tid of the new thread, or NOTHREAD on error.
+  @see CreateThread
+  */
+Tid_t CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -431,6 +456,8 @@ Fid_t OpenNull();
         Possible errors are:
          - The file descriptor is invalid.
          - There was a I/O runtime problem.
+        In non-blocking mode, it returns @c WOULD_BLOCK instead of waiting.
+  @see SetNonBlocking
  */
 int Read(Fid_t fd, char *buf, unsigned int size);
 
@@ -454,10 +481,93 @@ int Read(Fid_t fd, char *buf, unsigned int size);
    Possible errors are:
    - The file id is invalid.
    - There was a I/O runtime problem.
+   In non-blocking mode, it returns @c WOULD_BLOCK instead of waiting.
+  @see SetNonBlocking
  */
 int Write(Fid_t fd, const char* buf, unsigned int size);
 
 
+/** @brief The result of a call in non-blocking mode that would have to wait. 
+
+  @see SetNonBlocking
+*/
+#define WOULD_BLOCK (-2)
+
+
+/** @brief Set or clear the non-blocking mode of a stream.
+
+  In non-blocking mode, the calls that would wait for the stream return
+  @c WOULD_BLOCK at once instead: @c Read, @c Write, @c ReadV, @c WriteV,
+  @c Accept and @c RecvFrom. A transfer that can be done in part returns
+  what it did, as usual.
+
+  The mode belongs to the stream, so it is shared by all the file ids
+  of the stream (e.g., those made by @c Dup2).
+  @c Connect and @c Splice always wait as usual.
+
+  @param fd the file id of the stream
+  @param on non-zero to set non-blocking mode, 0 to clear it
+  @return 0 on success, -1 if @c fd is not a legal file id.
+ */
+int SetNonBlocking(Fid_t fd, int on);
+
+
+/** @brief A buffer for vectored I/O.
+
+  @see ReadV
+  @see WriteV
+ */
+typedef struct {
+  char* buf;          /**< @brief The start of the buffer */
+  unsigned int len;   /**< @brief The size of the buffer */
+} iovec_t;
+
+/** @brief The maximum number of buffers in a call to @c ReadV or @c WriteV. */
+#define MAX_IOV 64
+
+
+/** @brief Read into many buffers.
+
+  This is like @c Read(), except that the data is stored in the buffers
+  of @c iov, filling each one before moving to the next. 
+
+  On pipes and sockets, a single read is done for all the buffers: in
+  particular, a message of a packet pipe is spread over them. On other
+  streams, the buffers are read one by one, until a read returns less
+  than the size of its buffer.
+
+  @param fd the file descriptor to read from
+  @param iov the buffers
+  @param iovcnt the number of buffers, at most @c MAX_IOV
+  @return the total number of bytes read, 0 at the end of data, or -1 on 
+    error. Possible reasons for error are those of @c Read(), and:
+    - @c iovcnt is greater than @c MAX_IOV
+    - the total size of the buffers is greater than 2 Gbytes
+ */
+int ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/** @brief Write from many buffers.
+
+  This is like @c Write(), except that the data is taken from the buffers
+  of @c iov, one after the other.
+
+  On pipes and sockets, a single write is done for all the buffers: in
+  particular, a packet pipe gets a single message with all of them. On
+  other streams, the buffers are written one by one, until a write 
+  returns less than the size of its buffer.
+
+  @param fd the file descriptor to write to
+  @param iov the buffers
+  @param iovcnt the number of buffers, at most @c MAX_IOV
+  @return the total number of bytes written, or -1 on error. Possible 
+    reasons for error are those of @c Write(), and:
+    - @c iovcnt is greater than @c MAX_IOV
+    - the total size of the buffers is greater than 2 Gbytes
+ */
+int WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
 /** @brief Close a file id.
    
 
@@ -489,6 +599,152 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/** @brief Move data from one stream to another.
+
+  Read up to @c size bytes from @c fd_in and write them to @c fd_out, 
+  inside the kernel. Like @c Read(), the call blocks until some data is
+  available on @c fd_in, and it may move fewer than @c size bytes. 
+  Nothing is read from @c fd_in unless @c fd_out can take it: when 
+  @c fd_out is a pipe or a socket, the call first waits for room.
+
+  Between pipes and connected sockets, the data is copied directly from
+  one pipe buffer to the other. Between any other streams (such as a 
+  pipe and a terminal) it goes through a kernel buffer.
+
+  @param fd_in the file id to read from
+  @param fd_out the file id to write to
+  @param size the maximum number of bytes to move
+  @return the number of bytes moved, 0 if @c fd_in has reached the end of
+   data, or -1 on error. Possible reasons for failure:
+   - Either @c fd_in or @c fd_out is invalid.
+   - @c fd_in cannot be read, or @c fd_out cannot be written.
+   - An end of a pipe or socket is closed before anything is moved. If 
+     the reader of @c fd_out is closed while data is moved, that data is
+     dropped, as it would have been from the pipe.
+ */
+int Splice(Fid_t fd_in, Fid_t fd_out, unsigned int size);
+
+
+/** @brief The stream has data to read, or a read returns 0 at the end of data.
+	For a listening socket, @c Accept will not wait. */
+#define POLL_READ 0x01
+/** @brief The stream has space to write. */
+#define POLL_WRITE 0x02
+/** @brief A transfer on the stream fails, as an end of it is closed. */
+#define POLL_ERROR 0x04
+/** @brief The other end of the stream is closed, no more data will come. */
+#define POLL_HANGUP 0x08
+/** @brief The file id is not legal. */
+#define POLL_INVALID 0x10
+
+/** @brief A timeout for @c Poll that never expires. */
+#define NO_POLL_TIMEOUT ((timeout_t)-1)
+
+/** @brief A stream to wait for in @c Poll.
+
+  @see Poll
+ */
+typedef struct {
+  Fid_t fd;         /**< @brief The file id */
+  short events;     /**< @brief The events of interest, @c POLL_READ and/or @c POLL_WRITE */
+  short revents;    /**< @brief Set by @c Poll to the events that happened */
+} pollfd_t;
+
+
+/** @brief Wait until one of many streams is ready.
+
+  For each element of @c fds, @c Poll checks whether the stream can be read 
+  from (@c POLL_READ) or written to (@c POLL_WRITE) without waiting, and stores the
+  events that are requested in @c events, together with any of @c POLL_ERROR, 
+  @c POLL_HANGUP and @c POLL_INVALID, in @c revents. If no stream is ready, the
+  calling thread waits until one is, or the timeout expires.
+
+  Pipes, sockets and terminals are polled. Other streams never make a 
+  thread wait, and they are always ready for reading and writing.
+  Elements whose @c fd is @c NOFILE are skipped.
+
+  A stream that is ready may still block, if another thread uses it first,
+  or if a write is larger than the free space.
+
+  @param fds the streams to wait for
+  @param nfds the number of elements in @c fds, at most @c MAX_FILEID
+  @param timeout the time to wait in msec, 0 to return at once, or 
+     @c NO_POLL_TIMEOUT to wait for ever
+  @return the number of elements of @c fds with a non-zero @c revents (0 
+     if the timeout expired), or -1 if @c nfds is greater than @c MAX_FILEID.
+ */
+int Poll(pollfd_t* fds, unsigned int nfds, timeout_t timeout);
+
+
+/** @brief The operations of @c EventCtl. */
+typedef enum {
+  EVENT_ADD = 1,      /**< @brief Start watching a stream */
+  EVENT_MODIFY,       /**< @brief Change the events of interest of a watched stream */
+  EVENT_DELETE        /**< @brief Stop watching a stream */
+} event_op;
+
+/** @brief An event returned by @c WaitEvents. */
+typedef struct {
+  Fid_t fd;         /**< @brief The file id given to @c EventCtl for the stream */
+  short events;     /**< @brief The events of the stream, as in @c Poll */
+} event_t;
+
+
+/** @brief Create an event queue.
+
+  An event queue watches a set of streams. Unlike @c Poll, the streams are 
+  given once, with @c EventCtl, and @c WaitEvents only returns the streams
+  whose state has changed since they were last returned. Therefore, the cost
+  of @c WaitEvents depends on the number of events, not on the number of 
+  watched streams.
+
+  @return a file id for the event queue, or @c NOFILE on error. Possible reasons
+     for error:
+     - the available file ids for the process are exhausted
+ */
+Fid_t EventQueue();
+
+
+/** @brief Add, change or remove the watch of an event queue on a stream.
+
+  The watch reports the events in @c events (@c POLL_READ and/or @c POLL_WRITE),
+  and @c POLL_ERROR and @c POLL_HANGUP. When a stream is watched (or its 
+  events change) and it is ready, it is reported by the next @c WaitEvents.
+
+  A watch does not keep its stream open: when the stream is closed (i.e., 
+  when the last file id for it is closed), the watch is removed.
+
+  @param efd the event queue
+  @param op the operation
+  @param fd the stream
+  @param events the events of interest, ignored by @c EVENT_DELETE
+  @return 0 on success, -1 on error. Possible reasons for error:
+     - @c efd is not an event queue
+     - @c fd is not a legal file id, or it is an event queue
+     - @c op is @c EVENT_ADD and the stream is already watched
+     - @c op is @c EVENT_MODIFY or @c EVENT_DELETE and the stream is not watched
+ */
+int EventCtl(Fid_t efd, event_op op, Fid_t fd, int events);
+
+
+/** @brief Wait for the events of an event queue.
+
+  Return the events of the watched streams that have changed, waiting for one
+  if there are none. A stream is returned once after each change of its state
+  (e.g., a transfer, a connection request, or a close), if it has an event of
+  interest then; a stream that stays ready without changing is not returned again.
+
+  @param efd the event queue
+  @param events the array to store the events in
+  @param max the size of @c events
+  @param timeout the time to wait in msec, 0 to return at once, or 
+     @c NO_POLL_TIMEOUT to wait for ever
+  @return the number of events stored in @c events (0 if the timeout expired),
+     or -1 if @c efd is not an event queue or @c max is 0.
+ */
+int WaitEvents(Fid_t efd, event_t* events, unsigned int max, timeout_t timeout);
+
 /*******************************************
  *
  * Pipes
@@ -516,8 +772,8 @@ typedef struct pipe_s {
 
 	A pipe is a one-directional buffer accessed via two file ids,
 	one for each end of the buffer. The size of the buffer is 
-	implementation-specific, but can be assumed to be between 4 and 16 
-	kbytes. 
+	implementation-specific, but can be assumed to be at least 4 
+	kbytes. It can be changed with @c SetPipeCapacity(). 
 
 	Once a pipe is constructed, it remains operational as long as both
 	ends are open. If the read end is closed, the write end becomes 
@@ -531,6 +787,61 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+/**
+	@brief The maximum capacity of a pipe (4 Mbytes).
+*/
+#define MAX_PIPE_CAPACITY (4*1024*1024)
+
+/**
+	@brief The maximum memory for pipe buffers charged to a process (16 Mbytes).
+*/
+#define MAX_PIPE_MEMORY (16*1024*1024)
+
+/**
+	@brief Set the capacity of a pipe.
+
+	The buffer of the pipe is resized to hold @c capacity bytes. The
+	capacity is rounded up to a power of 2, and it is at least 4 kbytes.
+	The data already in the pipe is preserved.
+
+	Besides, the kernel grows the buffer of a pipe (up to 1 Mbyte) when 
+	writers keep finding no room for their writes, and shrinks it back to the capacity set
+	by this call when readers keep finding it empty.
+
+	The memory of a pipe buffer is charged to the process that created
+	or last resized it, until the pipe is closed or the process exits.
+
+	@param fd a file id for either end of a pipe
+	@param capacity the requested capacity in bytes
+	@returns the new capacity on success, or -1 on error. Possible reasons for error:
+		- @c fd is not a pipe end
+		- @c capacity is greater than @c MAX_PIPE_CAPACITY
+		- the data in the pipe does not fit in @c capacity bytes
+		- the pipe memory of the process would exceed @c MAX_PIPE_MEMORY
+*/
+int SetPipeCapacity(Fid_t fd, unsigned int capacity);
+
+/**
+	@brief Construct and return a packet pipe.
+
+	A packet pipe is like a pipe created by @c Pipe(), except that it
+	preserves the boundaries of writes: each successful @c Write() on
+	the write end puts a single message in the pipe, and each @c Read()
+	on the read end returns (at most) one whole message. If the buffer
+	given to @c Read() is smaller than the message, the message is 
+	truncated and the rest of it is discarded.
+
+	A message is written either entirely or not at all. The pipe buffer
+	grows to hold messages larger than its capacity, up to 
+	@c MAX_PIPE_CAPACITY. Empty writes are ignored.
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the available file ids for the process are exhausted.
+	@see Pipe
+*/
+int PacketPipe(pipe_t* pipe);
+
 /*******************************************
  *
  * Sockets (local)
@@ -571,6 +882,38 @@ typedef int16_t port_t;
 */
 Fid_t Socket(port_t port);
 
+/**
+	@brief Return a new packet socket bound on a port.
+
+	Like @c Socket(), except that the connections of the socket preserve
+	message boundaries, in the same way as the pipes made by 
+	@c PacketPipe(). A packet socket can only connect to a packet 
+	listener, and a stream socket only to a stream listener.
+
+	@param port the port the new socket will be bound to
+	@returns a file id for the new socket, or NOFILE on error. 
+	@see Socket
+	@see PacketPipe
+*/
+Fid_t PacketSocket(port_t port);
+
+/**
+	@brief Return a pair of connected sockets.
+
+	The two sockets are connected to each other, as if one had called
+	@c Connect() on a port where the other one was accepted, but without
+	using a port or a listener. Whatever is written to one socket is read
+	from the other. The sockets are not bound to a port, and they can be
+	shut down and closed like any connected socket.
+
+	@param sock an array where the file ids of the two sockets are stored
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the available file ids for the process are exhausted
+	@see Socket
+	@see Connect
+*/
+int SocketPair(Fid_t sock[2]);
+
 /**
 	@brief Initialize a socket as a listening socket.
 
@@ -590,9 +933,62 @@ Fid_t Socket(port_t port);
 		- the port bound to the socket is occupied by another listener
 		- the socket has already been initialized
 	@see Socket
+	@see ListenBacklog
  */
 int Listen(Fid_t sock);
 
+/**
+	@brief The backlog of a listening socket initialized by @c Listen().
+*/
+#define DEFAULT_BACKLOG 16
+
+/**
+	@brief The maximum backlog of a listening socket.
+*/
+#define MAX_BACKLOG 1024
+
+/**
+	@brief Initialize a socket as a listening socket, with a given backlog.
+
+	This is like @c Listen(), but the backlog of the listener (the number
+	of @c Connect() calls that may be pending on it at any time) is given.
+	When the backlog is full, @c Connect() fails immediately.
+
+	The resources of @c backlog connections are allocated by this call,
+	and they are reused by the connections the listener accepts. 
+
+	@param sock the socket to initialize as a listening socket
+	@param backlog the number of pending connection requests allowed, it 
+		is reduced to @c MAX_BACKLOG if it is larger
+	@returns 0 on success, -1 on error. Possible reasons for error are the 
+		same as for @c Listen(), and:
+		- @c backlog is 0
+	@see Listen
+ */
+int ListenBacklog(Fid_t sock, unsigned int backlog);
+
+/**
+	@brief Initialize a socket as a listening socket that shares its port.
+
+	This is like @c ListenBacklog(), except that the port may have other
+	listening sockets, as long as they were all initialized by this call
+	(and they are all stream sockets or all packet sockets). Each listener
+	has its own backlog, and it accepts its own connections.
+
+	@c Connect() on a shared port goes to the listener with the fewest
+	pending requests, and the listeners take turns when they are equally 
+	loaded. Thus, threads calling @c Accept() on different listeners of
+	the port do not contend with each other.
+
+	@param sock the socket to initialize as a listening socket
+	@param backlog the number of pending connection requests allowed
+	@returns 0 on success, -1 on error. Possible reasons for error are the 
+		same as for @c ListenBacklog(), except that the port may have
+		other listeners made by this call.
+	@see ListenBacklog
+ */
+int ListenShared(Fid_t sock, unsigned int backlog);
+
 
 /**
 	@brief Wait for a connection.
@@ -613,6 +1009,8 @@ int Listen(Fid_t sock);
 		- the file id is not initialized by @c Listen()
 		- the available file ids for the process are exhausted
 		- while waiting, the listening socket @c lsock was closed
+	    In non-blocking mode, it returns @c WOULD_BLOCK if there is no connection 
+	    request.
 
 	@see Connect
 	@see Listen
@@ -645,6 +1043,8 @@ Fid_t Accept(Fid_t lsock);
 	   - the given port is illegal.
 	   - the port does not have a listening socket bound to it by @c Listen.
 	   - the timeout has expired without a successful connection.
+	   - the backlog of the listening socket is full.
+	   - while waiting, the listening socket was closed.
 */
 int Connect(Fid_t sock, port_t port, timeout_t timeout);
 
@@ -694,6 +1094,220 @@ typedef enum {
 int ShutDown(Fid_t sock, shutdown_mode how);
 
 
+/**
+	@brief The maximum size of a datagram (8 kbytes).
+*/
+#define MAX_DATAGRAM 8192
+
+/**
+	@brief Return a new datagram socket bound on a port.
+
+	A datagram socket sends and receives messages (datagrams) to and from
+	other datagram sockets, without any connection, by @c SendTo() and 
+	@c RecvFrom(). @c Read() on a datagram socket is like @c RecvFrom(),
+	while @c Write() fails, since it does not say where the message goes.
+
+	Datagram sockets have their own ports: a port may be used by a 
+	datagram socket, and by stream or packet sockets, at the same time. At 
+	most one datagram socket is bound to each port. A socket on @c NOPORT
+	can send datagrams, but it cannot receive any.
+
+	@param port the port the new socket will be bound to
+	@returns a file id for the new socket, or NOFILE on error. Possible
+		reasons for error:
+		- the port is illegal
+		- the port has a datagram socket already
+		- the available file ids for the process are exhausted
+	@see SendTo
+	@see RecvFrom
+*/
+Fid_t DatagramSocket(port_t port);
+
+/**
+	@brief Send a datagram to a port.
+
+	The datagram is put in the queue of the datagram socket bound on 
+	@c port, along with the port of @c sock. This call never blocks: if 
+	the queue is full, the datagram is not sent.
+
+	@param sock a datagram socket
+	@param buf the message to send
+	@param size the size of the message, at most @c MAX_DATAGRAM
+	@param port the port of the receiving datagram socket
+	@returns @c size on success, or -1 on error. Possible reasons for error:
+		- @c sock is not a datagram socket
+		- @c size is greater than @c MAX_DATAGRAM
+		- no datagram socket is bound on @c port
+		- the queue of the receiving socket is full
+*/
+int SendTo(Fid_t sock, const char* buf, unsigned int size, port_t port);
+
+/**
+	@brief Receive a datagram.
+
+	Take the oldest datagram from the queue of the socket, waiting for
+	one if the queue is empty. If the datagram is larger than @c size,
+	it is truncated and the rest of it is discarded.
+
+	@param sock a datagram socket
+	@param buf the buffer where the message is stored
+	@param size the size of @c buf
+	@param port if not NULL, the port of the sender is stored there
+	@returns the number of bytes stored in @c buf, or -1 on error. 
+		Possible reasons for error:
+		- @c sock is not a datagram socket
+		- the socket is not bound to a port
+		- while waiting, the socket was closed
+		In non-blocking mode, it returns @c WOULD_BLOCK if the queue is empty.
+*/
+int RecvFrom(Fid_t sock, char* buf, unsigned int size, port_t* port);
+
+
+/** @brief The maximum number of entries of an I/O ring. */
+#define MAX_IORING_ENTRIES 256
+
+/** @brief The operations of an I/O ring. */
+typedef enum {
+  IO_READ = 1,      /**< @brief Like @c Read(fd, buf, size) */
+  IO_WRITE,         /**< @brief Like @c Write(fd, buf, size) */
+  IO_ACCEPT,        /**< @brief Like @c Accept(fd) */
+  IO_CONNECT        /**< @brief Like @c Connect(fd, port, timeout) */
+} io_opcode;
+
+/** @brief A submission, queued in the submission ring. */
+typedef struct {
+  io_opcode op;         /**< @brief The operation */
+  Fid_t fd;             /**< @brief The stream */
+  char* buf;            /**< @brief The buffer of @c IO_READ and @c IO_WRITE */
+  unsigned int size;    /**< @brief The size of @c buf */
+  port_t port;          /**< @brief The port of @c IO_CONNECT */
+  timeout_t timeout;    /**< @brief The timeout of @c IO_CONNECT */
+  uintptr_t user_data;  /**< @brief Copied to the completion */
+} io_sqe_t;
+
+/** @brief A completion, posted in the completion ring. */
+typedef struct {
+  uintptr_t user_data;  /**< @brief The @c user_data of the submission */
+  int result;           /**< @brief What the call of the operation would return */
+} io_cqe_t;
+
+/** @brief The rings of an I/O ring, shared by the process and the kernel.
+
+  The rings are arrays of @c entries elements, and the heads and tails
+  count the elements ever queued, so that the element of position @c i 
+  is at index <tt>i % entries</tt>. The process queues submissions at
+  @c sq_tail and takes completions at @c cq_head; the kernel advances
+  @c sq_head and @c cq_tail. A side should read the indices that the other 
+  side advances, and advance its own, atomically.
+
+  @see IoRingSetup
+ */
+typedef struct {
+  io_sqe_t* sq;             /**< @brief The submission ring */
+  io_cqe_t* cq;             /**< @brief The completion ring */
+  unsigned int entries;     /**< @brief The size of the rings, set by @c IoRingSetup */
+  unsigned int sq_head;     /**< @brief The next submission the kernel takes */
+  unsigned int sq_tail;     /**< @brief The next free submission entry */
+  unsigned int cq_head;     /**< @brief The next completion the process takes */
+  unsigned int cq_tail;     /**< @brief The next free completion entry */
+} io_ring_t;
+
+
+/** @brief Create an I/O ring.
+
+  An I/O ring runs I/O operations asynchronously. The process queues 
+  operations in the submission ring, and submits all of them with a single
+  call of @c IoRingEnter. Each operation is completed with a completion in
+  the completion ring, which has the result of the operation.
+
+  Reads and writes that can be done without waiting are completed during 
+  @c IoRingEnter. The rest of the operations are run by kernel threads of 
+  the process, so that they may complete in any order. A stream in 
+  non-blocking mode makes its operations complete with @c WOULD_BLOCK.
+
+  The caller sets @c sq and @c cq of @c ring to arrays of @c entries elements.
+  The memory of the rings and of the buffers must stay valid until the I/O 
+  ring is closed and all its operations have completed. Closing the I/O ring
+  does not cancel the operations that have been submitted; their completions 
+  are discarded.
+
+  @param ring the rings
+  @param entries the size of the rings, a power of two up to @c MAX_IORING_ENTRIES
+  @return a file id for the I/O ring, or @c NOFILE on error. Possible reasons
+     for error:
+     - @c ring, @c sq or @c cq is NULL
+     - @c entries is not a power of two, or it is too large
+     - the available file ids for the process are exhausted
+ */
+Fid_t IoRingSetup(io_ring_t* ring, unsigned int entries);
+
+
+/** @brief Submit the queued operations of an I/O ring, and wait for completions.
+
+  The submissions between @c sq_head and @c sq_tail are taken, as long as 
+  there is room in the completion ring for all the completions that are not
+  taken by the process yet; the rest stay queued. Then, the calling thread
+  waits until there are at least @c min_complete completions in the
+  completion ring, or the timeout expires, or no operation is running.
+  A submission with an illegal operation completes with -1.
+
+  @param ringfd the I/O ring
+  @param min_complete the number of completions to wait for
+  @param timeout the time to wait in msec, 0 to return at once, or 
+     @c NO_POLL_TIMEOUT to wait for ever
+  @return the number of operations submitted, or -1 if @c ringfd is not an
+     I/O ring.
+ */
+int IoRingEnter(Fid_t ringfd, unsigned int min_complete, timeout_t timeout);
+
+
+
+/*******************************************
+ *
+ * Batches of system calls
+ *
+ *******************************************/
+
+/** @brief The maximum number of calls of a batch. */
+#define MAX_BATCH 64
+
+/** @brief The system calls of a batch. */
+typedef enum {
+  BATCH_CLOSE = 1,    /**< @brief @c Close(fd) */
+  BATCH_DUP2,         /**< @brief @c Dup2(fd, newfd) */
+  BATCH_READ,         /**< @brief @c Read(fd, buf, size) */
+  BATCH_WRITE,        /**< @brief @c Write(fd, buf, size) */
+  BATCH_EXEC          /**< @brief @c Exec(task, argl, args) */
+} batch_call;
+
+/** @brief A system call of a batch, and its result. */
+typedef struct {
+  batch_call call;      /**< @brief The system call */
+  Fid_t fd;             /**< @brief The file id of all calls except @c BATCH_EXEC */
+  Fid_t newfd;          /**< @brief The second file id of @c BATCH_DUP2 */
+  char* buf;            /**< @brief The buffer of @c BATCH_READ and @c BATCH_WRITE */
+  unsigned int size;    /**< @brief The size of @c buf */
+  Task task;            /**< @brief The task of @c BATCH_EXEC */
+  int argl;             /**< @brief The argument length of @c BATCH_EXEC */
+  void* args;           /**< @brief The arguments of @c BATCH_EXEC */
+  int result;           /**< @brief Set to the return value of the call */
+} batch_op_t;
+
+
+/** @brief Make a number of system calls with one call.
+
+  The calls of @c ops are made in order, as if they were made one by one,
+  and the return value of each call is stored in its @c result. A call 
+  that fails does not stop the batch; a call with an illegal @c call 
+  gets a result of -1.
+
+  @param ops the calls
+  @param n the number of calls, at most @c MAX_BATCH
+  @return the number of calls with a non-negative result, or -1 if @c ops is
+     NULL or @c n is greater than @c MAX_BATCH.
+ */
+int SysBatch(batch_op_t* ops, unsigned int n);
+
 
 /*******************************************
  *
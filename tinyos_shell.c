@@ -845,28 +845,28 @@ int process_line(int argc, const char** argv)
 
 	pipe_t pipe;
 	for(int i=0; i<frag; i++) {
+		Fid_t out, in;
 		if(i<frag-1) {
 			/* Not the last fragment, make a pipe */
 			Pipe(& pipe);
-			Dup2(pipe.write,1);
-			Close(pipe.write);
+			out = pipe.write;
+			in = pipe.read;
 		} else {
-			/* Last fragment, restore saved 1 */
-			Dup2(saveout, 1);
-			Close(saveout);				
+			/* Last fragment, restore saved 0 and 1 */
+			out = saveout;
+			in = savein;
 		}
 
-		child[i] = Execute(COMMANDS[comd[i]].prog, Vargc[i], Vargv[i]);
-
-		if(i<frag-1) {
-			/* Not the last fragment, make a pipe */
-			Dup2(pipe.read,0);
-			Close(pipe.read);
-		} else {
-			/* Last fragment, restore saved 1 */
-			Dup2(savein, 0);
-			Close(savein);
-		}
+		/* Redirect 1, execute, and redirect 0 for the next fragment, in one call */
+		batch_op_t ops[5] = {
+			{ .call = BATCH_DUP2, .fd = out, .newfd = 1 },
+			{ .call = BATCH_CLOSE, .fd = out },
+			{ .call = BATCH_EXEC },
+			{ .call = BATCH_DUP2, .fd = in, .newfd = 0 },
+			{ .call = BATCH_CLOSE, .fd = in }
+		};
+		ExecuteBatch(COMMANDS[comd[i]].prog, Vargc[i], Vargv[i], ops, 5);
+		child[i] = ops[2].result;
 	}
 
 	/* Wait for the children */
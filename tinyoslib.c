@@ -168,6 +168,26 @@ int Execute(Program prog, size_t argc, const char** argv)
 }
 
 
+int ExecuteBatch(Program prog, size_t argc, const char** argv, batch_op_t* ops, unsigned int n)
+{
+	/* Pack the arguments as in Execute */
+	size_t argl = argvlen(argc, argv) + sizeof(prog);
+	char args[argl];
+	memcpy(args, &prog, sizeof(prog));
+	argvpack(args+sizeof(prog), argc, argv);
+
+	/* Fill in the calls that execute the program */
+	for(unsigned int i=0; i<n; i++)
+		if(ops[i].call == BATCH_EXEC) {
+			ops[i].task = exec_wrapper;
+			ops[i].argl = argl;
+			ops[i].args = args;
+		}
+
+	return SysBatch(ops, n);
+}
+
+
 
 void BarrierSync(barrier* bar, unsigned int n)
 {
@@ -44,6 +44,21 @@ typedef int (*Program)(size_t argc, const char** argv);
 int Execute(Program prog, size_t argc, const char** argv);
 
 
+/**
+	@brief Execute a new process, along with other system calls.
+
+	The calls of @c ops are made by a single @c SysBatch. Each call of
+	@c ops whose @c call is @c BATCH_EXEC executes @c prog with the given 
+	arguments, as @ref Execute does; its pid is stored in its @c result.
+
+	This is useful to set up the streams of a new process with fewer
+	system calls.
+
+	@returns the return value of @c SysBatch
+  */
+int ExecuteBatch(Program prog, size_t argc, const char** argv, batch_op_t* ops, unsigned int n);
+
+
 /**
 	@brief Try to reclaim the arguments of a process.
 
@@ -628,6 +628,25 @@ BOOT_TEST(test_read_kbd,
 }
 
 
+BOOT_TEST(test_poll_terminal,
+	"Test that Poll waits for input on terminal 0, and that Read gets all of it.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	pollfd_t fds[1] = { {fterm, POLL_READ|POLL_WRITE, 0} };
+	ASSERT(Poll(fds, 1, 0)==1 && fds[0].revents==POLL_WRITE);
+
+	sendme(0, "Hello");
+	fds[0].events = POLL_READ;
+	ASSERT(Poll(fds, 1, NO_POLL_TIMEOUT)==1 && fds[0].revents==POLL_READ);
+	checked_read(fterm, "Hello");
+	return 0;
+}
+
+
 BOOT_TEST(test_read_kbd_big,
 	"Test that we can read massively from the keyboard on terminal 0.",
 	.minimum_terminals = 1, .timeout = 20
@@ -758,6 +777,44 @@ BOOT_TEST(test_child_inherits_files,
 }
 
 
+static int batch_child(int argl, void* args)
+{
+	checked_read(10, "Hello child");
+	return 0;
+}
+
+BOOT_TEST(test_sys_batch,
+	"Test that SysBatch makes its calls in order, storing the result of each one,\n"
+	"and that a failed call does not stop the batch."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	batch_op_t ops[] = {
+		{ .call = BATCH_WRITE, .fd = p.write, .buf = "Hello child", .size = 11 },
+		{ .call = BATCH_DUP2, .fd = p.read, .newfd = 10 },
+		{ .call = BATCH_CLOSE, .fd = p.read },
+		{ .call = BATCH_EXEC, .task = batch_child },
+		{ .call = BATCH_CLOSE, .fd = 10 },
+		{ .call = BATCH_DUP2, .fd = p.read, .newfd = 10 },
+		{ .call = (batch_call) 99 }
+	};
+	ASSERT(SysBatch(ops, 7)==5);
+	ASSERT(ops[0].result==11 && ops[1].result==0 && ops[2].result==0);
+	ASSERT(ops[3].result!=NOPROC && ops[4].result==0);
+	ASSERT(ops[5].result==-1 && ops[6].result==-1);
+
+	int exitval;
+	ASSERT(WaitChild(ops[3].result, &exitval)==ops[3].result);
+	ASSERT(exitval==0);
+
+	ASSERT(SysBatch(NULL, 1)==-1);
+	ASSERT(SysBatch(ops, MAX_BATCH+1)==-1);
+	return 0;
+}
+
+
 
 
 BOOT_TEST(test_null_device,
@@ -930,6 +987,7 @@ TEST_SUITE(basic_tests,
 	&test_close_success_on_valid_nonfile_fid,
 	&test_close_terminals,
 	&test_read_kbd,
+	&test_poll_terminal,
 	&test_read_kbd_big,
 	&test_read_error_on_bad_fid,
 	&test_read_from_many_terminals,
@@ -938,6 +996,7 @@ TEST_SUITE(basic_tests,
 	&test_write_error_on_bad_fid,
 	&test_write_to_many_terminals,
 	&test_child_inherits_files,
+	&test_sys_batch,
 	NULL
 };
 
@@ -988,6 +1047,34 @@ BOOT_TEST(test_threadself,
 }
 
 
+static Tid_t threadself_tids[8];
+
+static int threadself_thread(int argl, void* args)
+{
+	Tid_t self = ThreadSelf();
+	/* Loop long enough to be preempted and migrate between cores */
+	for(int i=0; i<200000; i++) {
+		ASSERT(ThreadSelf() == self);
+		ASSERT(GetPid() == 1);
+		ASSERT(GetPPid() == NOPROC);
+	}
+	threadself_tids[argl] = self;
+	return 0;
+}
+
+BOOT_TEST(test_threadself_many_threads,
+	"Test that ThreadSelf, GetPid and GetPPid stay consistent in many threads under preemption")
+{
+	Tid_t tids[8];
+	for(int i=0; i<8; i++)
+		tids[i] = CreateThread(threadself_thread, i, NULL);
+	for(int i=0; i<8; i++) {
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+		ASSERT(threadself_tids[i] == tids[i]);
+	}
+	return 0;
+}
+
 
 BOOT_TEST(test_join_illegal_tid_gives_error,
 	"Test that ThreadJoin rejects an illegal Tid")
@@ -1398,10 +1485,60 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
+static int stack_size_task(int argl, void* args)
+{
+	/* Touch argl bytes of stack */
+	volatile char buf[argl];
+	for(int i=0; i<argl; i+=1024) buf[i] = (char) i;
+	return buf[argl-1024]==(char)(argl-1024) ? argl : -1;
+}
+
+BOOT_TEST(test_create_thread_stack,
+	"Test that threads with a small and a large stack can be created and joined."
+	)
+{
+	int exitval;
+	Tid_t t1 = CreateThreadStack(stack_size_task, 4*1024, NULL, 16*1024);
+	Tid_t t2 = CreateThreadStack(stack_size_task, 1024*1024, NULL, 2*1024*1024);
+	ASSERT(t1 != NOTHREAD);
+	ASSERT(t2 != NOTHREAD);
+
+	ASSERT(ThreadJoin(t1, &exitval)==0);
+	ASSERT(exitval == 4*1024);
+	ASSERT(ThreadJoin(t2, &exitval)==0);
+	ASSERT(exitval == 1024*1024);
+	return 0;
+}
+
+static int many_small_stacks_task(int argl, void* args)
+{
+	return argl;
+}
+
+BOOT_TEST(test_many_small_stack_threads,
+	"Test that many threads with a small stack (or the default stack) can exist at once."
+	)
+{
+	const int N = 2000;
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) {
+		tids[i] = CreateThreadStack(many_small_stacks_task, i, NULL, (i%2) ? 1 : 0);
+		ASSERT(tids[i] != NOTHREAD);
+	}
+	for(int i=0; i<N; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(tids[i], &exitval)==0);
+		ASSERT(exitval == i);
+	}
+	return 0;
+}
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
 {
+	&test_threadself_many_threads,
 	&test_join_illegal_tid_gives_error,
 	&test_detach_illegal_tid_gives_error,
 	&test_detach_self,
@@ -1416,6 +1553,8 @@ TEST_SUITE(thread_tests,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_create_thread_stack,
+	&test_many_small_stack_threads,
 	NULL
 };
 
@@ -1632,6 +1771,683 @@ BOOT_TEST(test_pipe_multi_producer,
 	return 0;
 }
 
+/* Reads argl bytes from the pipe read end in *args, checking the byte pattern */
+static int pattern_consumer(int argl, void* args)
+{
+	Fid_t fd = *(Fid_t*)args;
+	char buffer[1000];
+	int count = 0;
+
+	while(count < argl) {
+		int rc = Read(fd, buffer, 1000);
+		ASSERT(rc > 0);
+		for(int i=0; i<rc; i++)
+			ASSERT(buffer[i] == (char)((count+i) % 251));
+		count += rc;
+	}
+	ASSERT(count == argl);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_large_write,
+	"Test that a single Write much larger than the pipe buffer blocks until all of it\n"
+	"is written, and that the data wraps around the buffer correctly."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	static char data[65536+123];
+	int N = sizeof(data);
+	for(int i=0; i<N; i++) data[i] = (char)(i % 251);
+
+	Tid_t t = CreateThread(pattern_consumer, N, &pipe.read);
+	ASSERT(Write(pipe.write, data, N) == N);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* Odd-sized writes and reads wrap around the buffer */
+	for(int k=0; k<10; k++) {
+		ASSERT(Write(pipe.write, data, 3001) == 3001);
+		char buffer[3001];
+		int count = 0;
+		while(count < 3001) {
+			int rc = Read(pipe.read, buffer+count, 3001-count);
+			ASSERT(rc > 0);
+			count += rc;
+		}
+		ASSERT(memcmp(buffer, data, 3001)==0);
+	}
+
+	/* After the writer closes, the rest of the data is read, then EOF */
+	ASSERT(Write(pipe.write, data, 100) == 100);
+	Close(pipe.write);
+	char buffer[200];
+	ASSERT(Read(pipe.read, buffer, 200) == 100);
+	ASSERT(Read(pipe.read, buffer, 200) == 0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_set_capacity,
+	"Test that SetPipeCapacity resizes a pipe, keeping its data."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	ASSERT(SetPipeCapacity(NOFILE, 8192)==-1);
+	ASSERT(SetPipeCapacity(OpenNull(), 8192)==-1);
+	ASSERT(SetPipeCapacity(pipe.read, MAX_PIPE_CAPACITY+1)==-1);
+
+	/* Capacities are rounded up to a power of 2 */
+	ASSERT(SetPipeCapacity(pipe.write, 20000)==32768);
+	ASSERT(SetPipeCapacity(pipe.read, 100)==4096);
+	ASSERT(SetPipeCapacity(pipe.read, 32768)==32768);
+
+	/* Now a single write of 30000 bytes fits without a reader */
+	static char data[30000], buffer[30000];
+	for(int i=0; i<30000; i++) data[i] = (char)(i % 251);
+	ASSERT(Write(pipe.write, data, 30000)==30000);
+
+	/* The data does not fit in a smaller pipe */
+	ASSERT(SetPipeCapacity(pipe.write, 16384)==-1);
+
+	/* Growing keeps the data */
+	ASSERT(SetPipeCapacity(pipe.write, 65536)==65536);
+	ASSERT(Read(pipe.read, buffer, 10000)==10000);
+	ASSERT(SetPipeCapacity(pipe.write, 20000)==32768);
+	ASSERT(Read(pipe.read, buffer+10000, 30000)==20000);
+	ASSERT(memcmp(data, buffer, 30000)==0);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_memory_limit,
+	"Test that the pipe memory of a process is limited to MAX_PIPE_MEMORY."
+	)
+{
+	int n = MAX_PIPE_MEMORY / MAX_PIPE_CAPACITY;
+	pipe_t pipe[n+1];
+	for(int i=0; i<=n; i++)
+		ASSERT(Pipe(&pipe[i])==0);
+
+	/* The last pipe still holds its initial buffer, so only n-1 pipes fit */
+	for(int i=0; i<n-1; i++)
+		ASSERT(SetPipeCapacity(pipe[i].write, MAX_PIPE_CAPACITY)==MAX_PIPE_CAPACITY);
+	ASSERT(SetPipeCapacity(pipe[n-1].write, MAX_PIPE_CAPACITY)==-1);
+
+	/* Closing a pipe gives its memory back */
+	ASSERT(Close(pipe[0].read)==0);
+	ASSERT(Close(pipe[0].write)==0);
+	ASSERT(SetPipeCapacity(pipe[n-1].write, MAX_PIPE_CAPACITY)==MAX_PIPE_CAPACITY);
+
+	return 0;
+}
+
+
+/* Helpers for test_pipe_many_readers_writers */
+static int counting_writer(int argl, void* args)
+{
+	Fid_t fd = *(Fid_t*)args;
+	char buffer[777];
+	memset(buffer, 1, sizeof(buffer));
+	for(int i=0; i<argl; i++)
+		ASSERT(Write(fd, buffer, sizeof(buffer))==sizeof(buffer));
+	return 0;
+}
+
+static int counting_reader(int argl, void* args)
+{
+	Fid_t fd = *(Fid_t*)args;
+	char buffer[500];
+	int count = 0, rc;
+	while((rc = Read(fd, buffer, sizeof(buffer))) > 0)
+		for(int i=0; i<rc; i++) count += buffer[i];
+	ASSERT(rc==0);
+	return count;
+}
+
+BOOT_TEST(test_pipe_many_readers_writers,
+	"Test that no data is lost or stuck when many threads read and write the same pipe."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	const int N = 4, M = 200;
+	Tid_t w[N], r[N];
+	for(int i=0; i<N; i++) r[i] = CreateThread(counting_reader, 0, &pipe.read);
+	for(int i=0; i<N; i++) w[i] = CreateThread(counting_writer, M, &pipe.write);
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(w[i], NULL)==0);
+
+	Close(pipe.write);
+	int total = 0;
+	for(int i=0; i<N; i++) {
+		int count;
+		ASSERT(ThreadJoin(r[i], &count)==0);
+		total += count;
+	}
+	ASSERT(total == N*M*777);
+	return 0;
+}
+
+
+/* Helper for test_pipe_writer_wakes_for_small_space */
+static int read_one_and_ack(int argl, void* args)
+{
+	pipe_t* p = args;
+	char c;
+	ASSERT(Read(p[0].read, &c, 1)==1);
+	/* Wait for the writer to finish before reading more */
+	ASSERT(Read(p[1].read, &c, 1)==1);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_writer_wakes_for_small_space,
+	"Test that a writer blocked on a full pipe is woken when the space it needs\n"
+	"is freed, even if it is less than the wakeup watermark."
+	)
+{
+	pipe_t p[2];
+	ASSERT(Pipe(&p[0])==0);
+	ASSERT(Pipe(&p[1])==0);
+
+	/* Fill the pipe */
+	static char data[4096];
+	ASSERT(SetPipeCapacity(p[0].write, 4096)==4096);
+	ASSERT(Write(p[0].write, data, 4096)==4096);
+
+	Tid_t t = CreateThread(read_one_and_ack, 0, p);
+	/* This blocks until the reader takes one byte */
+	ASSERT(Write(p[0].write, data, 1)==1);
+	ASSERT(Write(p[1].write, data, 1)==1);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_packet_pipe,
+	"Test that a packet pipe preserves message boundaries, truncates messages larger\n"
+	"than the read buffer, and grows to hold messages larger than its capacity."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PacketPipe(&pipe)==0);
+
+	char buffer[64];
+	ASSERT(Write(pipe.write, "Hello", 5)==5);
+	ASSERT(Write(pipe.write, " world", 6)==6);
+	ASSERT(Write(pipe.write, "", 0)==0);
+	ASSERT(Read(pipe.read, buffer, 64)==5);
+	ASSERT(memcmp(buffer, "Hello", 5)==0);
+	ASSERT(Read(pipe.read, buffer, 64)==6);
+	ASSERT(memcmp(buffer, " world", 6)==0);
+
+	/* The tail of a truncated message is dropped */
+	ASSERT(Write(pipe.write, "0123456789", 10)==10);
+	ASSERT(Write(pipe.write, "abc", 3)==3);
+	ASSERT(Read(pipe.read, buffer, 4)==4);
+	ASSERT(memcmp(buffer, "0123", 4)==0);
+	ASSERT(Read(pipe.read, buffer, 64)==3);
+	ASSERT(memcmp(buffer, "abc", 3)==0);
+
+	/* A message larger than the pipe is written whole */
+	static char data[3*4096+17];
+	int N = sizeof(data);
+	for(int i=0; i<N; i++) data[i] = (char)(i % 251);
+	ASSERT(SetPipeCapacity(pipe.write, 4096)==4096);
+	ASSERT(Write(pipe.write, data, N)==N);
+	static char big[4*4096];
+	ASSERT(Read(pipe.read, big, sizeof(big))==N);
+	ASSERT(memcmp(big, data, N)==0);
+
+	/* Messages written before the close are read, then EOF */
+	ASSERT(Write(pipe.write, "abc", 3)==3);
+	Close(pipe.write);
+	ASSERT(Read(pipe.read, buffer, 64)==3);
+	ASSERT(Read(pipe.read, buffer, 64)==0);
+	return 0;
+}
+
+
+static int packet_flood(int argl, void* args)
+{
+	Fid_t fd = *(Fid_t*)args;
+	static char msg[3000];
+	int n = 0;
+	while(Write(fd, msg, sizeof(msg))==sizeof(msg)) n++;
+	return n;
+}
+
+BOOT_TEST(test_packet_pipe_waits_for_room,
+	"Test that a packet writer sleeps when the pipe has some space, but not enough for\n"
+	"its message, instead of growing the pipe."
+	)
+{
+	pipe_t pipe;
+	ASSERT(PacketPipe(&pipe)==0);
+	ASSERT(SetPipeCapacity(pipe.write, 4096)==4096);
+
+	/* Only the first message fits, and nobody reads */
+	Tid_t t = CreateThread(packet_flood, 0, &pipe.write);
+	Poll(NULL, 0, 100);
+
+	/* The pipe has not grown to hold more messages */
+	ASSERT(SetPipeCapacity(pipe.read, 4096)==4096);
+
+	Close(pipe.read);
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==1);
+	return 0;
+}
+
+
+static int splice_all(int argl, void* args)
+{
+	Fid_t* fd = args;
+	int rc;
+	while((rc = Splice(fd[0], fd[1], argl)) > 0);
+	ASSERT(rc == 0);
+	Close(fd[1]);
+	return 0;
+}
+
+BOOT_TEST(test_splice,
+	"Test that Splice moves data between pipes, sockets and other streams, in order,\n"
+	"and that it returns 0 at the end of the data."
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+
+	/* From pipe to pipe, in odd-sized pieces that wrap around both buffers */
+	static char data[65536+123];
+	int N = sizeof(data);
+	for(int i=0; i<N; i++) data[i] = (char)(i % 251);
+
+	Fid_t fd[2] = { p1.read, p2.write };
+	Tid_t splicer = CreateThread(splice_all, 3001, fd);
+	Tid_t reader = CreateThread(pattern_consumer, N, &p2.read);
+	ASSERT(Write(p1.write, data, N) == N);
+	Close(p1.write);
+	ASSERT(ThreadJoin(splicer, NULL)==0);
+	ASSERT(ThreadJoin(reader, NULL)==0);
+	char buffer[12];
+	ASSERT(Read(p2.read, buffer, 12)==0);
+
+	/* From a socket to a pipe, and from the pipe to a socket */
+	Fid_t sock[2];
+	ASSERT(SocketPair(sock)==0);
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Write(sock[0], "Hello world", 12)==12);
+	ASSERT(Splice(sock[1], p1.write, 100)==12);
+	ASSERT(Splice(p1.read, sock[1], 5)==5);
+	ASSERT(Splice(p1.read, sock[1], 100)==7);
+	ASSERT(Read(sock[0], buffer, 12)==12);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+
+	/* Packet pipes keep their messages */
+	ASSERT(PacketPipe(&p2)==0);
+	ASSERT(Write(p2.write, "Hello", 6)==6);
+	ASSERT(Write(p2.write, "world", 6)==6);
+	ASSERT(Splice(p2.read, sock[0], 100)==6);
+	ASSERT(Read(sock[1], buffer, 12)==6);
+	ASSERT(strcmp(buffer, "Hello")==0);
+
+	/* To another kind of stream */
+	Fid_t null = OpenNull();
+	ASSERT(Splice(p2.read, null, 100)==6);
+
+	/* Bad calls */
+	ASSERT(Splice(p1.write, p1.write, 100)==-1);
+	ASSERT(Splice(NOFILE, p1.write, 100)==-1);
+	ASSERT(Splice(p1.read, NOFILE, 100)==-1);
+	ASSERT(Write(p1.write, "Hello world", 12)==12);
+	Close(sock[0]);
+	ASSERT(Splice(p1.read, sock[1], 100)==-1);
+
+	return 0;
+}
+
+
+static int splice_once(int argl, void* args)
+{
+	Fid_t* fd = args;
+	return Splice(fd[0], fd[1], argl);
+}
+
+BOOT_TEST(test_splice_reader_closes,
+	"Test that when Splice waits for room in a pipe and the reader of the pipe closes,\n"
+	"it fails without taking anything from its input."
+	)
+{
+	pipe_t in, out;
+	ASSERT(PacketPipe(&in)==0);  /* This goes through a kernel buffer */
+	ASSERT(Pipe(&out)==0);
+	ASSERT(Write(in.write, "Hello", 6)==6);
+
+	static char junk[4096];  /* The pipe starts with 4K */
+	ASSERT(Write(out.write, junk, sizeof(junk))==sizeof(junk));
+
+	Fid_t fd[2] = { in.read, out.write };
+	Tid_t t = CreateThread(splice_once, 100, fd);
+	Poll(NULL, 0, 50);  /* Let it wait */
+	Close(out.read);
+
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==-1);
+
+	/* The message is still there */
+	char buffer[6];
+	ASSERT(SetNonBlocking(in.read, 1)==0);
+	ASSERT(Read(in.read, buffer, 6)==6);
+	ASSERT(strcmp(buffer, "Hello")==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_splice_waits_for_room,
+	"Test that Splice into a pipe that has some space, but not enough for the data,\n"
+	"waits for a reader to make room instead of growing the pipe."
+	)
+{
+	pipe_t in, out;
+	ASSERT(PacketPipe(&in)==0);
+	ASSERT(Pipe(&out)==0);
+	ASSERT(SetPipeCapacity(out.write, 4096)==4096);
+
+	static char msg[200];
+	for(unsigned i=0; i<sizeof(msg); i++) msg[i] = (char)i;
+	ASSERT(Write(in.write, msg, sizeof(msg))==sizeof(msg));
+
+	static char junk[4000];  /* Less than the message is left */
+	ASSERT(Write(out.write, junk, sizeof(junk))==sizeof(junk));
+
+	Fid_t fd[2] = { in.read, out.write };
+	Tid_t t = CreateThread(splice_once, 1000, fd);
+	Poll(NULL, 0, 100);  /* Let it wait */
+
+	/* The pipe has not grown to take the message */
+	ASSERT(SetPipeCapacity(out.read, 4096)==4096);
+
+	/* Make room */
+	static char buffer[4000];
+	ASSERT(Read(out.read, buffer, sizeof(buffer))==sizeof(buffer));
+
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval==sizeof(msg));
+	ASSERT(Read(out.read, buffer, sizeof(buffer))==sizeof(msg));
+	ASSERT(memcmp(buffer, msg, sizeof(msg))==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_readv_writev,
+	"Test that WriteV gathers its buffers into one write, and ReadV scatters one read\n"
+	"over its buffers, on pipes, packet pipes, sockets and other streams."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	/* A header and a payload, written together, wrapping around the buffer */
+	static char junk[4096-5];  /* The pipe starts with 4K */
+	ASSERT(Write(p.write, junk, sizeof(junk))==sizeof(junk));
+	ASSERT(Read(p.read, junk, sizeof(junk))==sizeof(junk));
+
+	char header[] = "HDR:";
+	char payload[] = "Hello world";
+	iovec_t out[3] = { {header, 4}, {NULL, 0}, {payload, 12} };
+	ASSERT(WriteV(p.write, out, 3)==16);
+
+	char h[4], b1[5], b2[20];
+	iovec_t in[3] = { {h, 4}, {b1, 5}, {b2, 20} };
+	ASSERT(ReadV(p.read, in, 3)==16);
+	ASSERT(memcmp(h, "HDR:", 4)==0);
+	ASSERT(memcmp(b1, "Hello", 5)==0);
+	ASSERT(strcmp(b2, " world")==0);
+
+	/* On a packet pipe, WriteV sends one message, and ReadV drops what does not fit */
+	pipe_t pp;
+	ASSERT(PacketPipe(&pp)==0);
+	ASSERT(WriteV(pp.write, out, 3)==16);
+	ASSERT(Write(pp.write, "next", 5)==5);
+	iovec_t small[2] = { {h, 4}, {b1, 5} };
+	ASSERT(ReadV(pp.read, small, 2)==9);
+	ASSERT(memcmp(b1, "Hello", 5)==0);
+	ASSERT(ReadV(pp.read, in, 3)==5);
+	ASSERT(memcmp(h, "next", 4)==0 && b1[0]==0);
+
+	/* Over a socket */
+	Fid_t sock[2];
+	ASSERT(SocketPair(sock)==0);
+	ASSERT(WriteV(sock[0], out, 3)==16);
+	ASSERT(ReadV(sock[1], in, 3)==16);
+	ASSERT(strcmp(b2, " world")==0);
+
+	/* Streams without vectored operations get one call per buffer */
+	Fid_t null = OpenNull();
+	ASSERT(WriteV(null, out, 3)==16);
+	ASSERT(ReadV(null, in, 3)==29);
+	ASSERT(h[0]==0 && b2[19]==0);
+
+	/* The end of data, and bad calls */
+	Close(p.write);
+	ASSERT(ReadV(p.read, in, 3)==0);
+	ASSERT(WriteV(p.read, out, 3)==-1);
+	ASSERT(ReadV(NOFILE, in, 3)==-1);
+	ASSERT(ReadV(null, in, MAX_IOV+1)==-1);
+	ASSERT(WriteV(null, NULL, 1)==-1);
+	iovec_t huge[2] = { {payload, 0x7fffffff}, {payload, 2} };
+	ASSERT(WriteV(null, huge, 2)==-1);
+
+	return 0;
+}
+
+
+static int poll_producer(int argl, void* args)
+{
+	Fid_t fd = *(Fid_t*)args;
+	for(int i=0; i<argl; i++)
+		ASSERT(Write(fd, "message", 8)==8);
+	Close(fd);
+	return 0;
+}
+
+BOOT_TEST(test_poll_pipes,
+	"Test that Poll reports the readiness of pipes, waits for them and times out,\n"
+	"and that one thread can read from many pipes with it."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	/* An empty pipe can be written, but not read */
+	pollfd_t fds[4] = { {p.read, POLL_READ, 0}, {p.write, POLL_WRITE, 0}, 
+		{12, POLL_READ, 0}, {NOFILE, POLL_READ, 0} };
+	ASSERT(Poll(fds, 4, 0)==2);
+	ASSERT(fds[0].revents==0 && fds[1].revents==POLL_WRITE);
+	ASSERT(fds[2].revents==POLL_INVALID && fds[3].revents==0);
+	ASSERT(Poll(fds, 1, 20)==0);
+
+	/* A full pipe can be read, but not written */
+	static char data[4096];
+	ASSERT(Write(p.write, data, sizeof(data))==sizeof(data));
+	ASSERT(Poll(fds, 2, 0)==1);
+	ASSERT(fds[0].revents==POLL_READ && fds[1].revents==0);
+
+	/* The reader sees the writer close */
+	ASSERT(Read(p.read, data, sizeof(data))==sizeof(data));
+	Close(p.write);
+	ASSERT(Poll(fds, 1, NO_POLL_TIMEOUT)==1);
+	ASSERT(fds[0].revents==(POLL_READ|POLL_HANGUP));
+	Close(p.read);
+
+	/* One thread reads from many pipes, as the data arrives */
+	enum { N = 4, MSGS = 200 };
+	Fid_t wr[N];
+	Tid_t tid[N];
+	pollfd_t set[N];
+	for(int i=0; i<N; i++) {
+		ASSERT(Pipe(&p)==0);
+		set[i] = (pollfd_t){ p.read, POLL_READ, 0 };
+		wr[i] = p.write;
+		tid[i] = CreateThread(poll_producer, MSGS, &wr[i]);
+	}
+
+	int open = N, count = 0;
+	while(open > 0) {
+		ASSERT(Poll(set, N, NO_POLL_TIMEOUT) > 0);
+		for(int i=0; i<N; i++) {
+			if(set[i].revents == 0) continue;
+			int rc = Read(set[i].fd, data, sizeof(data));
+			ASSERT(rc >= 0);
+			count += rc;
+			if(rc == 0) {
+				Close(set[i].fd);
+				set[i].fd = NOFILE;
+				open--;
+			}
+		}
+	}
+	ASSERT(count == N*MSGS*8);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+
+	pollfd_t many[MAX_FILEID+1];
+	ASSERT(Poll(many, MAX_FILEID+1, 0)==-1);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_event_queue,
+	"Test that an event queue reports the pipes it watches once per change, and\n"
+	"that it forgets the pipes that are closed."
+	)
+{
+	Fid_t eq = EventQueue();
+	ASSERT(eq!=NOFILE);
+	event_t ev[4];
+
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(EventCtl(eq, EVENT_ADD, p.read, POLL_READ)==0);
+	ASSERT(WaitEvents(eq, ev, 4, 0)==0);
+	ASSERT(WaitEvents(eq, ev, 4, 20)==0);
+
+	/* A write is reported once */
+	ASSERT(Write(p.write, "Hello", 6)==6);
+	ASSERT(WaitEvents(eq, ev, 4, NO_POLL_TIMEOUT)==1);
+	ASSERT(ev[0].fd==p.read && ev[0].events==POLL_READ);
+	ASSERT(WaitEvents(eq, ev, 4, 0)==0);
+
+	/* A ready stream is reported when it is added */
+	ASSERT(EventCtl(eq, EVENT_ADD, p.write, POLL_WRITE)==0);
+	ASSERT(WaitEvents(eq, ev, 4, 0)==1);
+	ASSERT(ev[0].fd==p.write && ev[0].events==POLL_WRITE);
+
+	/* Closing the writer removes its watch, and the reader sees it */
+	Close(p.write);
+	ASSERT(WaitEvents(eq, ev, 4, 0)==1);
+	ASSERT(ev[0].fd==p.read && ev[0].events==(POLL_READ|POLL_HANGUP));
+
+	/* Bad calls */
+	ASSERT(EventCtl(eq, EVENT_ADD, p.read, POLL_READ)==-1);
+	ASSERT(EventCtl(eq, EVENT_DELETE, p.read, 0)==0);
+	ASSERT(EventCtl(eq, EVENT_MODIFY, p.read, POLL_READ)==-1);
+	ASSERT(EventCtl(eq, EVENT_ADD, eq, POLL_READ)==-1);
+	ASSERT(EventCtl(p.read, EVENT_ADD, eq, POLL_READ)==-1);
+	ASSERT(WaitEvents(p.read, ev, 4, 0)==-1);
+	ASSERT(WaitEvents(eq, ev, 0, 0)==-1);
+	Close(p.read);
+
+	/* One thread reads from many pipes, as the data arrives */
+	enum { N = 4, MSGS = 200 };
+	Fid_t wr[N];
+	Tid_t tid[N];
+	for(int i=0; i<N; i++) {
+		ASSERT(Pipe(&p)==0);
+		ASSERT(EventCtl(eq, EVENT_ADD, p.read, POLL_READ)==0);
+		wr[i] = p.write;
+		tid[i] = CreateThread(poll_producer, MSGS, &wr[i]);
+	}
+
+	static char data[4096];
+	int open = N, count = 0;
+	while(open > 0) {
+		int n = WaitEvents(eq, ev, 4, NO_POLL_TIMEOUT);
+		ASSERT(n > 0);
+		for(int i=0; i<n; i++) {
+			int rc = Read(ev[i].fd, data, sizeof(data));
+			ASSERT(rc >= 0);
+			count += rc;
+			if(rc == 0) {
+				Close(ev[i].fd);
+				open--;
+			}
+		}
+	}
+	ASSERT(count == N*MSGS*8);
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+	ASSERT(WaitEvents(eq, ev, 4, 0)==0);
+
+	ASSERT(Close(eq)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_nonblocking,
+	"Test that in non-blocking mode, the pipe calls that would wait return WOULD_BLOCK,\n"
+	"and that the mode is shared by the file ids of the stream."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(SetNonBlocking(p.read, 1)==0);
+	ASSERT(SetNonBlocking(p.write, 1)==0);
+	ASSERT(SetNonBlocking(NOFILE, 1)==-1);
+
+	char buffer[12];
+	iovec_t iov[1] = { {buffer, 12} };
+	ASSERT(Read(p.read, buffer, 12)==WOULD_BLOCK);
+	ASSERT(ReadV(p.read, iov, 1)==WOULD_BLOCK);
+
+	/* Writes go as far as they can */
+	static char data[4096+100];
+	ASSERT(Write(p.write, data, sizeof(data))==4096);
+	ASSERT(Write(p.write, data, 1)==WOULD_BLOCK);
+	ASSERT(Read(p.read, data, sizeof(data))==4096);
+	ASSERT(Read(p.read, data, sizeof(data))==WOULD_BLOCK);
+
+	/* Dup2 shares the mode, and it can be cleared */
+	ASSERT(Dup2(p.read, 10)==0);
+	ASSERT(Read(10, buffer, 12)==WOULD_BLOCK);
+	ASSERT(SetNonBlocking(10, 0)==0);
+	ASSERT(Write(p.write, "Hello world", 12)==12);
+	ASSERT(Read(p.read, buffer, 12)==12);
+
+	/* The end of data, and errors, are reported as usual */
+	ASSERT(Write(p.read, buffer, 12)==-1);
+	Close(p.write);
+	ASSERT(SetNonBlocking(p.read, 1)==0);
+	ASSERT(Read(p.read, buffer, 12)==0);
+
+	/* Packet pipes only take whole messages */
+	ASSERT(PacketPipe(&p)==0);
+	ASSERT(SetNonBlocking(p.write, 1)==0);
+	ASSERT(Write(p.write, data, 3000)==3000);
+	ASSERT(Write(p.write, data, 3000)==WOULD_BLOCK);
+
+	return 0;
+}
+
 
 TEST_SUITE(pipe_tests,
 	"A suite of tests for pipes. We are focusing on correctness, not performance."
@@ -1643,6 +2459,20 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_close_writer,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
+	&test_pipe_large_write,
+	&test_pipe_set_capacity,
+	&test_pipe_memory_limit,
+	&test_pipe_many_readers_writers,
+	&test_pipe_writer_wakes_for_small_space,
+	&test_packet_pipe,
+	&test_packet_pipe_waits_for_room,
+	&test_splice,
+	&test_splice_reader_closes,
+	&test_splice_waits_for_room,
+	&test_readv_writev,
+	&test_poll_pipes,
+	&test_event_queue,
+	&test_pipe_nonblocking,
 	NULL
 };
 
@@ -2003,6 +2833,160 @@ BOOT_TEST(test_connect_fails_on_timeout,
 }
 
 
+static int connect_or_accept(int argl, void* args)
+{
+	int* failed = args;
+	Fid_t sock = Socket(NOPORT);
+	/* With an infinite timeout, Connect only fails if the backlog is full */
+	if(Connect(sock, 100, -1)==-1) {
+		__atomic_fetch_add(failed, 1, __ATOMIC_SEQ_CST);
+		ASSERT(Accept(argl)!=NOFILE);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_connect_fails_on_full_backlog,
+	"Test that Connect fails at once when the backlog of the listener is full."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(ListenBacklog(lsock, 0)==-1);
+	ASSERT(ListenBacklog(lsock, 1)==0);
+
+	/* One of them takes the only slot, the other fails and accepts it */
+	int failed = 0;
+	Tid_t t1 = CreateThread(connect_or_accept, lsock, &failed);
+	Tid_t t2 = CreateThread(connect_or_accept, lsock, &failed);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	ASSERT(ThreadJoin(t2, NULL)==0);
+	ASSERT(failed==1);
+
+	return 0;
+}
+
+static int connect_forever(int argl, void* args)
+{
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(Connect(sock, 100, -1)==-1);
+	return 0;
+}
+
+BOOT_TEST(test_listen_backlog_reuses_connections,
+	"Test that a listener with a small backlog serves many more connections than its\n"
+	"backlog over time, and that closing it fails the pending Connect calls."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(ListenBacklog(lsock, 2)==0);
+
+	for(uint i=0; i< 50; i++) {
+		Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+		Fid_t srv;
+		connect_sockets(cli, lsock, &srv, 100);
+		check_transfer(cli, srv);
+		check_transfer(srv, cli);
+		/* The first connections stay open while the next ones are made */
+		if(i >= 3) {
+			ASSERT(Close(cli)==0);
+			ASSERT(Close(srv)==0);
+		}
+	}
+
+	Tid_t t = CreateThread(connect_forever, 0, NULL);
+	ASSERT(Close(lsock)==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_listen_backlog_pipe_memory,
+	"Test that the pipes a listener keeps for its backlog are not charged to its process."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(ListenBacklog(lsock, MAX_BACKLOG)==0);
+
+	/* As in test_pipe_memory_limit, n-1 pipes of the largest capacity fit */
+	int n = MAX_PIPE_MEMORY / MAX_PIPE_CAPACITY;
+	pipe_t pipe[n];
+	for(int i=0; i<n; i++)
+		ASSERT(Pipe(&pipe[i])==0);
+	for(int i=0; i<n-1; i++)
+		ASSERT(SetPipeCapacity(pipe[i].write, MAX_PIPE_CAPACITY)==MAX_PIPE_CAPACITY);
+
+	return 0;
+}
+
+static int accept_and_count(int argl, void* args)
+{
+	int* count = args;
+	Fid_t sock;
+	while((sock = Accept(argl)) != NOFILE) {
+		check_transfer(sock, sock);
+		(*count)++;
+		Close(sock);
+	}
+	return 0;
+}
+
+static int connect_and_echo(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		Fid_t sock = Socket(NOPORT);
+		ASSERT(Connect(sock, 100, -1)==0);
+		char buffer[12];
+		ASSERT(Read(sock, buffer, 12)==12);
+		ASSERT(Write(sock, buffer, 12)==12);
+		Close(sock);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_listen_shared,
+	"Test that many listeners made by ListenShared can share a port, that they take\n"
+	"turns in serving connections, and that other listeners cannot join them."
+	)
+{
+	Fid_t lsock[2];
+	lsock[0] = Socket(100); ASSERT(lsock[0]!=NOFILE);
+	lsock[1] = Socket(100); ASSERT(lsock[1]!=NOFILE);
+	ASSERT(ListenShared(lsock[0], 4)==0);
+	ASSERT(ListenShared(lsock[1], 4)==0);
+
+	/* Only shared listeners of the same kind may join */
+	ASSERT(Listen(Socket(100))==-1);
+	ASSERT(ListenShared(PacketSocket(100), 4)==-1);
+	Fid_t plain = Socket(200);
+	ASSERT(Listen(plain)==0);
+	ASSERT(ListenShared(Socket(200), 4)==-1);
+	Close(plain);
+
+	/* Connect one at a time: the listeners are always equally loaded */
+	int count[2] = {0, 0};
+	Tid_t acc[2];
+	for(int i=0; i<2; i++)
+		acc[i] = CreateThread(accept_and_count, lsock[i], &count[i]);
+	Tid_t cli = CreateThread(connect_and_echo, 20, NULL);
+	ASSERT(ThreadJoin(cli, NULL)==0);
+
+	/* Closing one listener leaves the port to the other */
+	ASSERT(Close(lsock[0])==0);
+	ASSERT(ThreadJoin(acc[0], NULL)==0);
+	cli = CreateThread(connect_and_echo, 5, NULL);
+	ASSERT(ThreadJoin(cli, NULL)==0);
+
+	ASSERT(Close(lsock[1])==0);
+	ASSERT(ThreadJoin(acc[1], NULL)==0);
+	ASSERT(count[0]==10);
+	ASSERT(count[1]==15);
+
+	return 0;
+}
+
 
 BOOT_TEST(test_socket_small_transfer,
 	"Open a socket and put just a little data in it, in both directions, for many times."
@@ -2191,6 +3175,304 @@ BOOT_TEST(test_shudown_write,
 
 
 
+BOOT_TEST(test_packet_socket,
+	"Test that packet sockets preserve message boundaries, and that they do not connect\n"
+	"to stream listeners or vice versa."
+	)
+{
+	Fid_t lsock = PacketSocket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	ASSERT(Connect(cli, 100, 100)==-1);
+
+	Fid_t slsock = Socket(200);   ASSERT(slsock!=NOFILE);
+	ASSERT(Listen(slsock)==0);
+	Fid_t pcli = PacketSocket(NOPORT); ASSERT(pcli!=NOFILE);
+	ASSERT(Connect(pcli, 200, 100)==-1);
+
+	Fid_t srv;
+	connect_sockets(pcli, lsock, &srv, 100);
+
+	char buffer[12];
+	for(uint i=0; i< 100; i++) {
+		ASSERT(Write(pcli, "Hello", 6)==6);
+		ASSERT(Write(pcli, "world", 6)==6);
+		ASSERT(Read(srv, buffer, 12)==6);
+		ASSERT(strcmp(buffer, "Hello")==0);
+		ASSERT(Read(srv, buffer, 12)==6);
+		ASSERT(strcmp(buffer, "world")==0);
+		check_transfer(srv, pcli);
+	}
+
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_pair,
+	"Test that SocketPair returns two connected sockets that transfer data both ways,\n"
+	"shut down and close like accepted sockets, and do not occupy a port."
+	)
+{
+	Fid_t sock[2];
+	ASSERT(SocketPair(sock)==0);
+	ASSERT(sock[0]!=NOFILE && sock[1]!=NOFILE && sock[0]!=sock[1]);
+
+	for(uint i=0; i< 2000; i++) {
+		check_transfer(sock[0], sock[1]);
+		check_transfer(sock[1], sock[0]);
+	}
+
+	/* A pair is already connected */
+	ASSERT(Listen(sock[0])==-1);
+	ASSERT(Connect(sock[1], 100, 100)==-1);
+
+	ASSERT(Write(sock[0], "Hello world", 12)==12);
+	ASSERT(ShutDown(sock[0], SHUTDOWN_WRITE)==0);
+	char buffer[12];
+	ASSERT(Read(sock[1], buffer, 12)==12);
+	ASSERT(Read(sock[1], buffer, 12)==0);
+	check_transfer(sock[1], sock[0]);
+
+	ASSERT(Close(sock[1])==0);
+	ASSERT(Write(sock[0], "Hello world", 12)==-1);
+	ASSERT(Close(sock[0])==0);
+
+	/* Pairs fail when the file ids are exhausted */
+	Fid_t s[2];
+	for(uint i=0; i< MAX_FILEID/2; i++)
+		ASSERT(SocketPair(s)==0);
+	ASSERT(SocketPair(s)==-1);
+
+	return 0;
+}
+
+
+static int recv_until_closed(int argl, void* args)
+{
+	char buffer[12];
+	ASSERT(RecvFrom(argl, buffer, 12, NULL)==-1);
+	return 0;
+}
+
+BOOT_TEST(test_datagram_socket,
+	"Test that datagram sockets exchange datagrams without connecting, that they have\n"
+	"their own ports, and that their queues are bounded."
+	)
+{
+	/* Datagram ports are separate from stream ports */
+	Fid_t lsock = Socket(100); ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	Fid_t a = DatagramSocket(100); ASSERT(a!=NOFILE);
+	ASSERT(DatagramSocket(100)==NOFILE);
+	ASSERT(DatagramSocket(MAX_PORT+1)==NOFILE);
+	Fid_t b = DatagramSocket(200); ASSERT(b!=NOFILE);
+	Fid_t c = DatagramSocket(NOPORT); ASSERT(c!=NOFILE);
+
+	char buffer[12];
+	port_t from;
+	ASSERT(SendTo(a, "Hello", 6, 200)==6);
+	ASSERT(SendTo(c, "world", 6, 200)==6);
+	ASSERT(SendTo(b, "Hello world", 12, 100)==12);
+	ASSERT(RecvFrom(b, buffer, 12, &from)==6);
+	ASSERT(strcmp(buffer, "Hello")==0 && from==100);
+	ASSERT(RecvFrom(b, buffer, 12, &from)==6);
+	ASSERT(strcmp(buffer, "world")==0 && from==NOPORT);
+	/* Truncated, the rest is lost */
+	ASSERT(RecvFrom(a, buffer, 5, &from)==5);
+	ASSERT(memcmp(buffer, "Hello", 5)==0 && from==200);
+
+	/* Read is like RecvFrom, Write has nowhere to go */
+	ASSERT(SendTo(a, "Hello world", 12, 200)==12);
+	ASSERT(Read(b, buffer, 12)==12);
+	ASSERT(Write(a, "Hello world", 12)==-1);
+
+	/* Bad calls */
+	static char big[MAX_DATAGRAM+1];
+	ASSERT(SendTo(a, big, MAX_DATAGRAM+1, 200)==-1);
+	ASSERT(SendTo(a, "Hello", 6, 300)==-1);
+	ASSERT(SendTo(lsock, "Hello", 6, 200)==-1);
+	ASSERT(RecvFrom(lsock, buffer, 12, NULL)==-1);
+	ASSERT(RecvFrom(c, buffer, 12, NULL)==-1);
+	ASSERT(Connect(a, 100, 100)==-1);
+
+	/* A full queue refuses datagrams, until it is drained */
+	int sent = 0;
+	while(SendTo(a, big, 1000, 200)==1000)
+		sent++;
+	ASSERT(sent > 10 && sent < 100);
+	for(int i=0; i<sent; i++)
+		ASSERT(RecvFrom(b, big, MAX_DATAGRAM, NULL)==1000);
+	ASSERT(SendTo(a, big, 1000, 200)==1000);
+	ASSERT(RecvFrom(b, big, MAX_DATAGRAM, NULL)==1000);
+
+	/* Closing the socket fails the waiting receivers, and frees the port */
+	Tid_t t = CreateThread(recv_until_closed, b, NULL);
+	ASSERT(Close(b)==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(SendTo(a, "Hello", 6, 200)==-1);
+	ASSERT(DatagramSocket(200)!=NOFILE);
+
+	return 0;
+}
+
+
+static int poll_connect(int argl, void* args)
+{
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(Connect(sock, argl, 1000)==0);
+	ASSERT(Write(sock, "Hello", 6)==6);
+	Close(sock);
+	return 0;
+}
+
+BOOT_TEST(test_poll_sockets,
+	"Test that Poll reports when a listener has a connection to accept, and when\n"
+	"a connected or datagram socket has data."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	pollfd_t fds[2] = { {lsock, POLL_READ, 0} };
+	ASSERT(Poll(fds, 1, 0)==0);
+
+	/* Wait for a connection, and then for its data */
+	Tid_t t = CreateThread(poll_connect, 100, NULL);
+	ASSERT(Poll(fds, 1, NO_POLL_TIMEOUT)==1 && fds[0].revents==POLL_READ);
+	Fid_t peer = Accept(lsock);
+	ASSERT(peer!=NOFILE);
+	ASSERT(Poll(fds, 1, 0)==0);
+
+	fds[0] = (pollfd_t){ peer, POLL_READ, 0 };
+	ASSERT(Poll(fds, 1, NO_POLL_TIMEOUT)==1 && fds[0].revents & POLL_READ);
+	char buffer[6];
+	ASSERT(Read(peer, buffer, 6)==6);
+	ASSERT(strcmp(buffer, "Hello")==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(Poll(fds, 1, NO_POLL_TIMEOUT)==1 && fds[0].revents & POLL_HANGUP);
+
+	/* A socket pair can be written both ways */
+	Fid_t sock[2];
+	ASSERT(SocketPair(sock)==0);
+	fds[0] = (pollfd_t){ sock[0], POLL_READ|POLL_WRITE, 0 };
+	fds[1] = (pollfd_t){ sock[1], POLL_READ|POLL_WRITE, 0 };
+	ASSERT(Poll(fds, 2, 0)==2);
+	ASSERT(fds[0].revents==POLL_WRITE && fds[1].revents==POLL_WRITE);
+
+	/* A datagram socket is readable once a datagram is queued */
+	Fid_t d1 = DatagramSocket(200), d2 = DatagramSocket(201);
+	fds[0] = (pollfd_t){ d2, POLL_READ, 0 };
+	ASSERT(Poll(fds, 1, 0)==0);
+	ASSERT(SendTo(d1, "Hello", 6, 201)==6);
+	ASSERT(Poll(fds, 1, 0)==1 && fds[0].revents==POLL_READ);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_nonblocking,
+	"Test that in non-blocking mode, Accept and RecvFrom return WOULD_BLOCK instead\n"
+	"of waiting."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(SetNonBlocking(lsock, 1)==0);
+	ASSERT(Accept(lsock)==WOULD_BLOCK);
+
+	/* An event loop accepts when Poll says so */
+	Tid_t t = CreateThread(poll_connect, 100, NULL);
+	pollfd_t fds[1] = { {lsock, POLL_READ, 0} };
+	ASSERT(Poll(fds, 1, NO_POLL_TIMEOUT)==1);
+	Fid_t peer = Accept(lsock);
+	ASSERT(peer>=0);
+	ASSERT(Accept(lsock)==WOULD_BLOCK);
+
+	char buffer[6];
+	ASSERT(SetNonBlocking(peer, 1)==0);
+	int rc;
+	while((rc = Read(peer, buffer, 6)) == WOULD_BLOCK) {
+		fds[0] = (pollfd_t){ peer, POLL_READ, 0 };
+		ASSERT(Poll(fds, 1, NO_POLL_TIMEOUT)==1);
+	}
+	ASSERT(rc==6 && strcmp(buffer, "Hello")==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	Fid_t d1 = DatagramSocket(200), d2 = DatagramSocket(201);
+	ASSERT(SetNonBlocking(d2, 1)==0);
+	ASSERT(RecvFrom(d2, buffer, 6, NULL)==WOULD_BLOCK);
+	ASSERT(Read(d2, buffer, 6)==WOULD_BLOCK);
+	ASSERT(SendTo(d1, "Hello", 6, 201)==6);
+	ASSERT(RecvFrom(d2, buffer, 6, NULL)==6);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_io_ring,
+	"Test that an I/O ring runs a batch of socket operations with one call, that the\n"
+	"ones that wait are completed by workers, and that submissions wait for room in\n"
+	"the completion ring."
+	)
+{
+	static io_sqe_t sq[8];
+	static io_cqe_t cq[8];
+	io_ring_t ring = { .sq = sq, .cq = cq };
+	ASSERT(IoRingSetup(&ring, 6)==NOFILE);
+	ASSERT(IoRingSetup(&ring, 2*MAX_IORING_ENTRIES)==NOFILE);
+	Fid_t rfd = IoRingSetup(&ring, 8);
+	ASSERT(rfd!=NOFILE);
+	ASSERT(IoRingEnter(NOFILE, 0, 0)==-1);
+
+	Fid_t lsock = Socket(100), csock = Socket(NOPORT);
+	ASSERT(Listen(lsock)==0);
+
+	/* Accept and Connect wait for each other, in workers */
+	sq[0] = (io_sqe_t){ .op = IO_ACCEPT, .fd = lsock, .user_data = 1 };
+	sq[1] = (io_sqe_t){ .op = IO_CONNECT, .fd = csock, .port = 100, .timeout = 1000, .user_data = 2 };
+	sq[2] = (io_sqe_t){ .op = (io_opcode) 99, .user_data = 3 };
+	ring.sq_tail = 3;
+	ASSERT(IoRingEnter(rfd, 3, NO_POLL_TIMEOUT)==3);
+	ASSERT(ring.sq_head==3 && ring.cq_tail==3);
+
+	Fid_t peer = NOFILE;
+	for(unsigned int i=0; i<3; i++) {
+		if(cq[i].user_data==1) peer = cq[i].result;
+		else if(cq[i].user_data==2) ASSERT(cq[i].result==0);
+		else ASSERT(cq[i].user_data==3 && cq[i].result==-1);
+	}
+	ASSERT(peer>=0);
+	ring.cq_head = 3;
+
+	/* A read that waits goes to a worker, the write that it waits for completes at once */
+	char buffer[6];
+	sq[3] = (io_sqe_t){ .op = IO_READ, .fd = peer, .buf = buffer, .size = 6, .user_data = 4 };
+	ring.sq_tail = 4;
+	ASSERT(IoRingEnter(rfd, 0, 0)==1);
+	ASSERT(ring.cq_tail==3);
+	sq[4] = (io_sqe_t){ .op = IO_WRITE, .fd = csock, .buf = "Hello", .size = 6, .user_data = 5 };
+	ring.sq_tail = 5;
+	ASSERT(IoRingEnter(rfd, 2, NO_POLL_TIMEOUT)==1);
+	ASSERT(ring.cq_tail==5);
+	ASSERT(cq[3].result==6 && cq[4].result==6);
+	ASSERT(strcmp(buffer, "Hello")==0);
+
+	/* With two completions not taken, six of the eight writes are submitted */
+	for(unsigned int i=5; i<13; i++)
+		sq[i%8] = (io_sqe_t){ .op = IO_WRITE, .fd = csock, .buf = "x", .size = 1, .user_data = i };
+	ring.sq_tail = 13;
+	ASSERT(IoRingEnter(rfd, 0, 0)==6);
+	ASSERT(ring.sq_head==11 && ring.cq_tail==11);
+	ring.cq_head = 11;
+	ASSERT(IoRingEnter(rfd, 2, NO_POLL_TIMEOUT)==2);
+	ASSERT(ring.cq_tail==13);
+	ASSERT(Read(peer, buffer, 6)==6);
+
+	ASSERT(Close(rfd)==0);
+	return 0;
+}
+
+
 TEST_SUITE(socket_tests,
 	"A suite of tests for sockets."
 	)
@@ -2218,6 +3500,10 @@ TEST_SUITE(socket_tests,
 	&test_connect_fails_on_illegal_port,
 	&test_connect_fails_on_non_listened_port,
 	&test_connect_fails_on_timeout,
+	&test_connect_fails_on_full_backlog,
+	&test_listen_backlog_reuses_connections,
+	&test_listen_backlog_pipe_memory,
+	&test_listen_shared,
 
 	&test_socket_small_transfer,
 	&test_socket_single_producer,
@@ -2226,6 +3512,13 @@ TEST_SUITE(socket_tests,
 	&test_shudown_read,
 	&test_shudown_write,
 
+	&test_packet_socket,
+	&test_socket_pair,
+	&test_datagram_socket,
+	&test_poll_sockets,
+	&test_socket_nonblocking,
+	&test_io_ring,
+
 	NULL
 };
 